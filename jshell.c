@@ -4,52 +4,741 @@
   @brief        JShell, expanded upon LSH, by Stephen Brennan (github.com/brenns10/lsh/)
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sched.h>
 #include <limits.h>
+#include <time.h>
 #include <netdb.h>
 #include <pwd.h>
-
-#define TOKEN_BUFFER_SIZE 32
-#define MAX_WORD_SIZE 100
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <malloc.h>
+#include <stdint.h>
 
 #define JSHELL_PROMPT ">> "
+#define JSHELL_CONTINUATION_PROMPT "> "
 #define JSHELL_PIPE "|"
+#define JSHELL_BACKGROUND "&"
+#define JSHELL_REDIRECT_IN "<"
+#define JSHELL_REDIRECT_OUT ">"
+#define JSHELL_REDIRECT_APPEND ">>"
+#define JSHELL_REDIRECT_ERR "2>"
+#define JSHELL_REDIRECT_ERR_APPEND "2>>"
+#define JSHELL_REDIRECT_ERR_OUT "2>&1"
 #define JSHELL_LINE_BUFFER_SIZE 1024
+#define JSHELL_READ_BUFFER_SIZE 65536
+#define JSHELL_ARENA_BLOCK_SIZE 65536
+#define JSHELL_ARENA_ALIGN 16
+#define JSHELL_STAGE_BUFFER_SIZE 8
+#define JSHELL_PATH_CACHE_SIZE 64
+#define JSHELL_GLOB_CACHE_SIZE 64         // directory listings, at most half of the slots are used
+#define JSHELL_GLOB_RACY_NS 20000000      // coarser than any file system's mtime ticks
+#define JSHELL_ENV_SIZE 128
+#define JSHELL_PLAN_CACHE_SIZE 64
+#define JSHELL_PLAN_CACHE_BUCKETS 128
+#define JSHELL_FUNCTION_TABLE_SIZE 16
+#define JSHELL_JOB_BUFFER_SIZE 16
+#define JSHELL_HISTORY_FILE ".jshell_history"
+#define JSHELL_SEARCH_LABEL "(reverse-i-search)`"
+#define JSHELL_TERMINAL_COLUMNS 80    // when the terminal doesn't say
+#define JSHELL_COMPLETION_POLL_MS 30000    // mtime check for what inotify can't see, like NFS
+#define JSHELL_COMPLETION_LIST_LIMIT 256
+#define JSHELL_HISTORY_TRIGRAMS 4096
+#define JSHELL_PIPE_SIZE 1048576    // the default pipe-max-size for unprivileged users
+#define JSHELL_PARALLEL_SEPARATOR ":::"
+#define JSHELL_BENCH_ITERATIONS 1000
+#define JSHELL_STRESS_ROUNDS 100
+#define JSHELL_STRESS_JOBS 64             // background pipelines at once
+#define JSHELL_STRESS_HEAP_SLACK 4096
+#define JSHELL_SERVER_BACKLOG 64
+#define JSHELL_SERVER_EVENTS 64
+#define JSHELL_EVENT_RING_SIZE 256
+#define JSHELL_EVENT_READ_SIZE 65536    // one event_read(), a pipe's worth at the default size
+#define JSHELL_FRAME_SIZE 65536          // largest payload of one frame
+#define JSHELL_CLIENT_BUFFER_LIMIT 1048576    // pending output before a worker is throttled
+#define JSHELL_TRACE_EVENTS 4096          // ring slots, a power of two
+#define JSHELL_TRACE_BUFFER_SIZE 65536
+#define JSHELL_TRACE_DETAIL 48
+#define JSHELL_STARTUP_PHASES 16
 #define JSHELL_GENERIC_LIMIT 1024
-#define JSHELL_EXIT_CODE 27
+#define JSHELL_EXIT_CODE -1    // never a valid exit status
 #define JSHELL_SUCCESS 0
 #define JSHELL_FAILED 1
+#define JSHELL_NOT_FOUND 127
+#define JSHELL_USAGE 2
+
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// Bump allocator for memory that only lives for one command
+struct Arena {
+    struct ArenaBlock* head;
+    size_t total;    // capacity of all blocks, used to size the block after a reset
+};
+
+// Where an arena was, everything allocated after it goes with arena_release()
+struct ArenaMark {
+    struct ArenaBlock* block;
+    size_t used;
+};
+
+// File a stage's stdin, stdout or stderr is opened from
+struct Redirect {
+    char* path;    // NULL when the fd is left to the pipeline
+    int flags;     // open(2) flags
+};
+
+// One command of a pipeline, argv points into the token array
+struct Stage {
+    char** argv;
+    struct Builtin* builtin;    // NULL for external commands
+    const char* path;           // resolved program, valid while path_generation matches the cache
+    unsigned long path_generation;
+    struct Redirect redirects[3];
+    int err_to_out;             // 2>&1, applied after stdout is set up
+    char** assigns;             // NAME=value words before the command, just before argv
+    int n_assigns;
+};
+
+// A parsed line, ready to run
+struct Plan {
+    struct Stage* stages;
+    int n_stages;
+    int n_args;    // length of the token array the stages point into, NULL included
+    int background;
+    int timed;     // prefixed with `time`
+    char* pin;     // prefixed with `pin`: the CPU list or "auto"
+    char* cgroup;  // and `pin -g`: the cgroup leaf
+    char* text;    // the line as typed, for job listings
+};
+
+#define NODE_COMMAND 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_FOR 3
+#define NODE_FUNCTION 4
+#define NODE_GROUP 5
+
+// CPUs the shell may run on, in the order `pin auto` hands them out
+struct Topology {
+    int* order;
+    long* packages;    // package of each cpu in `order`
+    int count;
+    int cursor;        // where the next pipeline starts
+};
+
+// Where the stages of a pinned pipeline go, for the time it's spawned
+struct Placement {
+    int active;        // the shell's affinity is changed
+    cpu_set_t saved;
+    cpu_set_t set;     // an explicit CPU list
+    int* cpus;         // `pin auto`: one cpu per stage
+    int procs_fd;      // cgroup.procs of the leaf, -1 for none
+};
+
+// A parsed command of a script, lists are chained through `next`
+struct Node {
+    int type;
+    struct Node* next;
+    char* text;            // COMMAND: its source, expanded when it runs. FOR: the words
+                           // after `in`, NULL for "$@". FUNCTION: the body's source.
+    struct Plan* plan;     // COMMAND with nothing to expand, planned once
+    struct Node* cond;     // IF, WHILE
+    struct Node* body;     // IF: then. WHILE, FOR: do. GROUP: { ... }
+    struct Node* orelse;   // IF: elif or else
+    char* name;            // FOR: the variable. FUNCTION: its name.
+    int negate;            // WHILE: it's an until
+};
+
+#define PARSE_OK 0
+#define PARSE_INCOMPLETE 1    // a quote or construct is still open at the end
+#define PARSE_ERROR 2
+
+struct Parser {
+    const char* text;
+    size_t pos;
+    size_t start;    // the last token
+    size_t end;
+    int state;
+};
+
+struct Function {
+    char* name;            // NULL marks a free slot
+    struct Node* body;     // in function_arena
+    char* text;            // the body's source, in function_arena too
+};
+
+struct FunctionTable {
+    struct Function* slots;    // open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+};
+
+// Recently run lines, keyed by the hash of the raw text
+struct PlanEntry {
+    struct PlanEntry* lru_prev;
+    struct PlanEntry* lru_next;
+    struct PlanEntry* bucket_next;
+    unsigned long long hash;
+    size_t length;
+    char* raw;
+    struct Plan plan;    // stages, argv and tokenized text share the entry's allocation
+};
+
+struct PlanCache {
+    struct PlanEntry* buckets[JSHELL_PLAN_CACHE_BUCKETS];
+    struct PlanEntry* lru_head;    // most recently used
+    struct PlanEntry* lru_tail;
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+// Entries of the history file sharing one trigram, in increasing order
+struct HistoryTrigram {
+    unsigned int key;    // the three bytes plus one, 0 marks a free slot
+    unsigned int* ids;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+// The history file is only appended to. It's mapped the first time it's
+// used and trigram indexed the first time it's searched, later on only
+// what other sessions (or this one) appended since is added on top.
+struct History {
+    int fd;                   // O_APPEND, -1 until the first line is saved
+    char* map;
+    size_t mapped;
+    size_t indexed;           // bytes of the file covered by offsets[]
+    size_t* offsets;          // start of every entry
+    unsigned int count;
+    unsigned int capacity;
+    struct HistoryTrigram* trigrams;    // open addressing, capacity is a power of two
+    size_t trigram_capacity;
+    size_t trigram_count;
+    unsigned int trigram_indexed;    // entries already in trigrams[]
+};
+
+// A shell variable, exported ones make up the environment of children
+struct EnvEntry {
+    char* pair;            // "NAME=value", NULL for a free slot
+    size_t name_length;
+    int exported;
+};
+
+struct Env {
+    struct EnvEntry* entries;    // open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+    char** envp;                 // exported pairs, rebuilt only when dirty
+    int dirty;
+};
+
+// Cached PATH resolution of a command name
+struct PathEntry {
+    char* name;
+    char* path;
+    unsigned int hits;
+};
+
+struct PathCache {
+    struct PathEntry* entries;    // open addressing, capacity is a power of two
+    size_t capacity;
+    size_t count;
+    char* path_env;               // PATH the entries were resolved against
+    unsigned long generation;     // bumped whenever entries are dropped
+};
+
+// One name of a directory listing
+struct GlobName {
+    char* name;
+    unsigned char type;    // d_type
+};
+
+// Sorted listing of one directory, reused while its mtime stays the same
+struct GlobDir {
+    dev_t dev;
+    ino_t ino;                 // 0 marks a free slot
+    struct timespec mtime;     // tv_sec -1 when the listing can't be trusted later
+    struct GlobName* names;
+    int count;
+    char* data;                // the names' bytes
+};
+
+struct GlobCache {
+    struct GlobDir dirs[JSHELL_GLOB_CACHE_SIZE];    // open addressing on dev and inode
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+#define GLOB_LITERAL 0
+#define GLOB_ANY 1
+#define GLOB_STAR 2
+#define GLOB_CLASS 3
+
+// A pattern component compiled to a sequence of these
+struct GlobOp {
+    int type;
+    const char* literal;       // GLOB_LITERAL, a run of plain characters
+    size_t length;
+    unsigned char set[32];     // GLOB_CLASS, bitmap of the bytes it takes
+};
+
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+struct JobProcess {
+    pid_t pid;
+    int state;
+    int status;
+    char* name;              // only kept for timed jobs
+    struct timespec end;
+    struct rusage usage;
+};
+
+// A launched pipeline. Everything the shell spawns lives in the job table
+// until it is reaped, foreground commands included.
+struct Job {
+    int id;               // %id, index in the table plus one
+    pid_t pgid;           // 0 when job control is off
+    struct JobProcess* procs;
+    int n_procs;
+    int last_spawned;     // the pipeline's final command was launched
+    int failed_status;    // the status instead when it wasn't, 1 for a failed redirection
+    int background;       // report it when it finishes
+    int timed;
+    struct timespec start;
+    char* command;
+};
+
+// One in-flight command of the parallel builtin
+struct ParallelSlot {
+    struct Job* job;
+    int out_fd;           // read end of its stdout when output is grouped, -1 otherwise
+    int pid_fd;           // pidfd of its command, -1 once reaped or without pidfds
+    char* output;
+    size_t length;
+    size_t capacity;
+};
+
+struct JobTable {
+    struct Job** jobs;
+    int capacity;
+    int current;          // id used by fg/bg without an argument
+    int sigchld_pipe[2];  // self-pipe written by the SIGCHLD handler
+};
+
+// What a watched fd is waited for, indexed by the fd
+struct EventWatch {
+    unsigned long long data;    // handed back with its events
+    unsigned int events;        // poll(2) bits, 0 when not watched
+    unsigned int generation;    // tags its io_uring requests, stale completions don't match
+    int armed;                  // a poll or read is in flight (io_uring) or it's in the epoll set
+    int queued;                 // waiting in the arm list
+    int reading;                // watched with event_read() instead
+    char* buffer;               // where those reads land, owned by the loop
+};
+
+// A read buffer whose fd was unwatched while the read was in flight, freed
+// when the cancelled read completes
+struct EventRetired {
+    unsigned long long tag;
+    char* buffer;
+};
+
+// Readiness and reads for the prompt, parallel and the server. io_uring
+// when the kernel has it, epoll otherwise.
+struct EventLoop {
+    int backend;
+    int fd;                     // the ring or the epoll instance
+    struct EventWatch* watches;
+    int n_watches;
+    int* arm;                   // fds whose poll is submitted with the next wait
+    int n_arm;
+    int arm_capacity;
+    struct EventRetired* retired;
+    int n_retired;
+    int retired_capacity;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct Event {
+    unsigned long long data;
+    unsigned int events;
+    long result;           // for event_read(): what read(2) returned, -errno on errors
+    const char* buffer;    // and the bytes, valid until the next event_read() of the fd
+};
+
+// A finished span of the JSHELL_TRACE file
+struct TraceEvent {
+    const char* name;
+    long long start;       // ns
+    long long duration;
+    pid_t tid;
+    unsigned long seq;     // slot number + 1 once the event is complete
+    char detail[JSHELL_TRACE_DETAIL];
+};
+
+// Ring of spans waiting to be written out, tail..head
+struct Trace {
+    int fd;                 // -1 when tracing is off
+    pid_t pid;
+    struct TraceEvent* events;
+    unsigned long head;     // next slot to reserve
+    unsigned long tail;     // next slot to write out
+    unsigned long dropped;
+    char* buffer;           // JSON on its way to fd
+};
+
+#define SUBSYSTEM_ENV 0
+#define SUBSYSTEM_BUILTINS 1
+#define SUBSYSTEM_JOBS 2
+#define SUBSYSTEM_PROMPT 3
+#define SUBSYSTEM_COMPLETION 4
+#define SUBSYSTEM_TOPOLOGY 5
+
+// Something built on first use
+struct Subsystem {
+    const char* name;
+    void (*init)();
+    int ready;
+};
+
+struct StartupPhase {
+    const char* name;
+    long long at;      // ns since main()
+    long long took;
+};
+
+// What --startup-profile reports
+struct Startup {
+    int profile;
+    int first;           // the first command hasn't finished yet
+    long long origin;    // main() was entered
+    int n_phases;
+    struct StartupPhase phases[JSHELL_STARTUP_PHASES];
+};
 
 void raise_error(char* message);
-void free_double_pointer(void** ptr);
+unsigned long long jshell_hash(const char* data, size_t length);
+void* arena_alloc(struct Arena* arena, size_t size);
+void arena_reset(struct Arena* arena);
+struct ArenaMark arena_mark(struct Arena* arena);
+void arena_release(struct Arena* arena, struct ArenaMark mark);
 int is_delimiter(char c);
+long long trace_begin();
+void trace_end(long long start, const char* name, const char* detail);
+void trace_flush();
+void trace_fork();
+void trace_close();
+long long trace_now();
+void subsystem_need(int id);
+void subsystem_start(int id);
+void startup_first_command(long long start);
+int glob_has_meta(const char* pattern, const char* end);
+int is_operator(char c);
+int is_operator_token(const char* token);
+char* split_operator(char* line, size_t* i, int err);
+const char* expand_ref(const char* ref, size_t* consumed);
 char** split_line(char* line);
-void print_prompt();
+void prompt_init();
+void prompt_refresh_cwd();
+void show_prompt();
 void jshell_loop();
 char* jshell_read_line();
-int jshell_run(char** args);
+char* editor_read_line();
+int editor_apply(int key);
+int reader_open_script(const char* path);
+void reader_open_string(char* string);
+void path_cache_clear();
+void env_init();
+const char* env_get(const char* name);
+void env_set(const char* name, size_t name_length, const char* value, int exported);
+void env_unset(const char* name);
+char** env_envp();
+char** env_stage_envp(struct Stage* stage);
+int is_assignment(const char* word);
+void path_cache_forget(const char* name);
+const char* path_cache_lookup(const char* name);
+void glob_cache_clear();
+char** glob_expand(const char* pattern, int* count);
+void builtin_table_init();
+struct Builtin* builtin_lookup(const char* name);
+void plan_cache_clear();
+struct Plan* plan_cache_lookup(const char* line, size_t length, unsigned long long hash);
+struct Plan* plan_cache_insert(const char* raw, size_t length, unsigned long long hash,
+                               struct Plan* plan, char** args, char* line);
+int history_open();
+void history_add(const char* line);
+int history_sync();
+const char* history_entry(unsigned int id, size_t* length);
+void completion_start();
+struct Trie* completion_trie();
+int history_search(const char* query, int before);
+void jobs_init();
+struct Job* job_create(const char* command, int n_procs);
+void job_free(struct Job* job);
+int job_state(struct Job* job);
+struct Job* job_find_pid(pid_t pid);
+void jobs_reap(int block);
+void jobs_notify();
+int jobs_finished();
+int job_foreground(struct Job* job, int resume);
+void event_init();
+void event_reset();
+void event_watch(int fd, unsigned int events, unsigned long long data);
+void event_unwatch(int fd);
+void event_read(int fd, unsigned long long data);
+void input_wait(int fd, void (*notify)());
+int event_wait(struct Event* events, int max);
+int pidfd_open_pid(pid_t pid);
+int redirect_open(struct Stage* stage, int fds[3]);
+void redirect_close(int fds[3]);
+pid_t jshell_spawn(struct Stage *stage, int in_fd, int out_fd, int err_fd, pid_t pgid);
+pid_t jshell_spawn_fork(const char* path, char** argv, char** envp, int in_fd, int out_fd, int err_fd, pid_t pgid);
+pid_t jshell_spawn_builtin(struct Stage *stage, int in_fd, int out_fd, int err_fd, pid_t pgid);
 int jshell_cd(char **args);
 int jshell_help(char **args);
 int jshell_exit(char **args);
-int jshell_exec_pipe(char **left_args, char **right_args);
-int jshell_pipe(char **args);
+int jshell_hash_builtin(char **args);
+int jshell_cache(char **args);
+int jshell_jobs(char **args);
+int jshell_fg(char **args);
+int jshell_bg(char **args);
+int jshell_wait(char **args);
+int jshell_parallel(char **args);
+int jshell_time(char **args);
+int jshell_pin(char **args);
+void topology_init();
+int cpu_list_parse(const char* text, cpu_set_t* set);
+int placement_begin(struct Plan* plan, struct Placement* placement);
+void placement_stage(struct Placement* placement, int stage);
+void placement_enter();
+void placement_end(struct Placement* placement);
+int jshell_break(char **args);
+int jshell_continue(char **args);
+int jshell_return(char **args);
+int jshell_echo(char **args);
+int jshell_true(char **args);
+int jshell_false(char **args);
+int jshell_test(char **args);
+int jshell_bracket(char **args);
+int jshell_pwd(char **args);
+int jshell_command(char **args);
+int jshell_history(char **args);
+int jshell_export(char **args);
+int jshell_unset(char **args);
+int jshell_exec_pipe(struct Plan *plan);
+struct Plan* jshell_plan(char **args);
+int jshell_exec_plan(struct Plan *plan);
 int jshell_exec(char **args);
+int jshell_run_line(char *line);
+char* jshell_capture(const char* text, size_t length, size_t* output_length);
+void subshell_init();
+int jshell_run_source(char* line);
+int program_parse(const char* text, struct Node** program);
+int program_plan(struct Node* node);
+int program_run(struct Node* node);
+struct Function* function_lookup(const char* name);
+int function_call(struct Function* function, char** argv);
+int jshell_wait_status(int status);
+int jshell_bench(int iterations);
+int jshell_stress(int rounds, double min_rate);
+int jshell_server(const char* path);
+int jshell_connect(const char* path, char** words);
 void init();
 int main(int argc, char** argv);
 
+struct Reader {
+    int fd;
+    char* buffer;
+    size_t capacity;
+    size_t start;    // first byte not yet returned
+    size_t end;      // one past the last byte read
+    int eof;         // also set up front for scripts and -c strings, which are never refilled
+};
+
+// Prefix trie of command names, nodes index into one array
+struct TrieNode {
+    int child;       // first child, -1 for none
+    int sibling;     // next child of the same parent, -1 for none
+    char c;
+    char terminal;   // a name ends here
+};
+
+struct Trie {
+    struct TrieNode* nodes;    // nodes[0] is the root
+    int count;
+    int capacity;
+};
+
+// The trie is built and rebuilt by a background thread, which hands it over
+// through `pending`. Only the main thread ever reads it, from `current`.
+struct Completion {
+    struct Trie* current;
+    struct Trie* pending;
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;      // guards path_env
+    char* path_env;            // PATH the thread should index
+    int wake_pipe[2];          // PATH changed, rebuild
+};
+
+#define KEY_LEFT 256
+#define KEY_RIGHT 257
+#define KEY_UP 258
+#define KEY_DOWN 259
+#define KEY_HOME 260
+#define KEY_END 261
+#define KEY_DELETE 262
+
+// Raw-mode line editor. `shown` is what the terminal has after the prompt,
+// each refresh only rewrites the part of it that changed.
+struct Editor {
+    char* line;
+    size_t length;
+    size_t cursor;
+    size_t capacity;
+    char* shown;
+    size_t shown_length;
+    size_t shown_cursor;
+    size_t shown_capacity;
+    char* out;            // terminal output of one keypress, sent with one write
+    size_t out_length;
+    size_t out_capacity;
+    char escape[8];       // escape sequence split across reads
+    int escape_length;
+    unsigned char input[256];    // read from the terminal, what's left after Enter is the next line's
+    size_t input_start;
+    size_t input_end;
+    size_t columns;       // terminal width
+    size_t origin;        // column the line starts at, after the prompt
+    int history_id;       // entry shown by up/down, history.count for the new line
+    char* saved;          // the new line while browsing history
+    int searching;        // in Ctrl-R mode
+    char query[JSHELL_GENERIC_LIMIT];
+    int match;            // entry found by the search, -1 for none
+    int last_key;         // a second Tab in a row lists the candidates
+};
+
+// Frames of the --server protocol: a type byte, a 32-bit big-endian
+// payload length and the payload.
+//   client -> server  'c' command text, 'i' stdin data (empty at EOF)
+//   server -> client  'o' stdout, 'e' stderr, 'x' exit status (4 bytes)
+#define FRAME_COMMAND 'c'
+#define FRAME_STDIN 'i'
+#define FRAME_STDOUT 'o'
+#define FRAME_STDERR 'e'
+#define FRAME_EXIT 'x'
+#define FRAME_HEADER 5
+
+struct Buffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+// One connection of the server, each runs one command in a forked worker
+struct ServerClient {
+    int fd;
+    pid_t worker;          // 0 until the command arrived, -1 once reaped
+    int status;
+    int exit_sent;         // the 'x' frame, after all of the output
+    int in_fd;             // worker's stdin, -1 once closed
+    int out_fd;            // worker's stdout, -1 at EOF
+    int err_fd;            // worker's stderr, -1 at EOF
+    int pid_fd;            // pidfd of the worker, -1 once reaped or without pidfds
+    int throttled;         // output isn't read while the client is behind
+    int stdin_eof;         // close in_fd once `input` is drained
+    struct Buffer request; // bytes from the client not yet parsed
+    struct Buffer input;   // stdin for the worker
+    struct Buffer output;  // frames for the client
+};
+
 struct Builtin {
     char* name;
     int (*func) (char**);
+    int pure;    // leaves the shell's state alone, $(...) runs it without forking
+};
+
+// Collision free table over builtins[], one probe per lookup
+struct BuiltinTable {
+    struct Builtin** slots;
+    unsigned long long multiplier;
+    int shift;
 };
 
 struct Builtin builtins[] = {
-    { "cd", &jshell_cd },
-    { "help", &jshell_help },
-    { "exit", &jshell_exit }
+    { "cd", &jshell_cd, 0 },
+    { "help", &jshell_help, 1 },
+    { "exit", &jshell_exit, 0 },
+    { "hash", &jshell_hash_builtin, 0 },
+    { "cache", &jshell_cache, 0 },
+    { "jobs", &jshell_jobs, 0 },
+    { "fg", &jshell_fg, 0 },
+    { "bg", &jshell_bg, 0 },
+    { "wait", &jshell_wait, 0 },
+    { "parallel", &jshell_parallel, 0 },
+    { "time", &jshell_time, 0 },
+    { "pin", &jshell_pin, 0 },
+    { "echo", &jshell_echo, 1 },
+    { "true", &jshell_true, 1 },
+    { "false", &jshell_false, 1 },
+    { "test", &jshell_test, 1 },
+    { "[", &jshell_bracket, 1 },
+    { "pwd", &jshell_pwd, 1 },
+    { "command", &jshell_command, 1 },
+    { "history", &jshell_history, 1 },
+    { "export", &jshell_export, 0 },
+    { "unset", &jshell_unset, 0 },
+    { "break", &jshell_break, 0 },
+    { "continue", &jshell_continue, 0 },
+    { "return", &jshell_return, 0 }
 };
 
 int jshell_num_builtins() {
@@ -63,422 +752,7598 @@ void raise_error(char* message){
     exit(EXIT_FAILURE);
 }
 
+// 64-bit FNV-1a
+unsigned long long jshell_hash(const char* data, size_t length){
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
 
-void free_double_pointer(void** ptr){
-    int i;
-    
-    for(i=0; ptr[i]!=NULL; i++){
-        free(ptr[i]);
+    for(i=0; i<length; i++){
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
     }
-    free(ptr);
-} 
+    return h;
+}
 
-// END CONTROL UTILITIES
+struct Arena jshell_arena = { NULL, 0 };
 
-// PARSING
+void* arena_alloc(struct Arena* arena, size_t size){
+    struct ArenaBlock* block = arena->head;
+    size_t block_size;
+    void* ptr;
 
-int is_delimiter(char c){
+    size = (size + JSHELL_ARENA_ALIGN - 1) & ~(size_t)(JSHELL_ARENA_ALIGN - 1);
 
-    if(c == ' '  ||
-       c == '\t' ||
-       c == '\r' ||
-       c == '\n' ||
-       c == '\a')
-    {
-        return 1;
+    if(!block || block->size - block->used < size){
+        block_size = size > JSHELL_ARENA_BLOCK_SIZE ? size : JSHELL_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct ArenaBlock) + block_size);
+        if(!block){
+            raise_error("Failed allocation of `arena block`.");
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+        arena->total += block_size;
     }
 
-    return 0;
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
 }
 
-char** split_line(char *line){
-    int buffer_size = TOKEN_BUFFER_SIZE;
-    int current_token = 0;
-
-    int in_quotes = 0;
-    int i, j;
+void arena_reset(struct Arena* arena){
+    struct ArenaBlock* block = arena->head;
+    struct ArenaBlock* next;
+    size_t total = arena->total;
 
-    char** tokens = malloc(buffer_size*sizeof(char*));
-    if(!tokens){
-        raise_error("Failed allocation of `tokens`.");
+    if(!block || !block->next){
+        if(block){
+            block->used = 0;
+        }
+        return;
     }
 
-    char* token = malloc(MAX_WORD_SIZE*sizeof(char));
-    if(!token){
-        raise_error("Failed allocation of `token`.");
+    // the last command needed several blocks, so keep a single one big enough for it
+    for(; block; block = next){
+        next = block->next;
+        free(block);
     }
+    arena->head = NULL;
+    arena->total = 0;
+    arena_alloc(arena, total);
+    arena->head->used = 0;
+}
 
-    for(i=0, j=0;; i++){
-        if(line[i] == '\0')
-            goto End_token;
-
-        if(line[i] == '"'){
-
-            if(!in_quotes){
-                in_quotes = 1;
-                continue;
-            }
-            else{
-                if(!is_delimiter(line[i+1]) && line[i+1]!='\0'){
-                    raise_error("Expected delimiter after end quote.");
-                }
+struct ArenaMark arena_mark(struct Arena* arena){
+    struct ArenaMark mark;
 
-                in_quotes = 0;
-                i++;  // skip to delimiter after end quote
-                goto End_token;
-            }
-        }
+    mark.block = arena->head;
+    mark.used = arena->head ? arena->head->used : 0;
+    return mark;
+}
 
-        // if character is not delimiter, add to token and move on
-        if(!is_delimiter(line[i]) || in_quotes){
-            token[j] = line[i];
-            j++;
-        }
-        else{
-            End_token:
-            
-            if(current_token >= buffer_size){
-                buffer_size += TOKEN_BUFFER_SIZE;
-                tokens = realloc(tokens, buffer_size*sizeof(char*));
-                if(!tokens) {
-                    raise_error("Failed allocation of `tokens`.");
-                }
-            }
-            
-            if(!j)
-            {
-                // if token is empty and EOF, just end parsing
-                if(line[i]=='\0')  
-                    break;
-                // if not, skip to next character
-                else  
-                    continue;
-            }
+// Frees what was allocated since `mark`, so loops run in constant memory
+void arena_release(struct Arena* arena, struct ArenaMark mark){
+    struct ArenaBlock* next;
 
-            token[j] = '\0';
-            tokens[current_token] = token;
+    while(arena->head && arena->head != mark.block){
+        next = arena->head->next;
+        arena->total -= arena->head->size;
+        free(arena->head);
+        arena->head = next;
+    }
+    if(arena->head){
+        arena->head->used = mark.used;
+    }
+}
 
-            token = malloc(MAX_WORD_SIZE*sizeof(char));
-            if(!token){
-                raise_error("Failed allocation of `token`.");
-            }
+// END CONTROL UTILITIES
 
-            j = 0;
-            current_token++;
-            
-            if(line[i]=='\0'){
-                free(token);  // dispose newly created token
-                break;
-            }
-        }
+// TRACE
 
-    }
+struct Trace trace = { -1, 0, NULL, 0, 0, 0, NULL };
 
-    if(in_quotes){
-        raise_error("Parsing ended unexpectedly.");
-    }
+// Timestamps are CLOCK_MONOTONIC, the clock `perf record -k mono` uses,
+// so both can be lined up
+long long trace_now(){
+    struct timespec now;
 
-    tokens[current_token] = NULL;
-    return tokens;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000LL + now.tv_nsec;
 }
 
-// END PARSING
-
-// JSHELL
+// Opens `path` for the trace of this shell and whatever it forks. The
+// file is a Chrome trace-event array: about:tracing, Perfetto and
+// speedscope read it without the closing bracket too.
+void trace_open(const char* path){
+    char header[128];
+    int n;
 
-void show_prompt(){
-    char cwd[PATH_MAX];
-    struct passwd* pwd;
-    char hostname[JSHELL_GENERIC_LIMIT];
-    struct hostent* h;
-    
-    if(getcwd(cwd, sizeof(cwd)) == NULL){
-        perror("getcwd() error");
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(trace.fd < 0){
+        fprintf(stderr, "jshell: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    trace.events = calloc(JSHELL_TRACE_EVENTS, sizeof(struct TraceEvent));
+    trace.buffer = malloc(JSHELL_TRACE_BUFFER_SIZE);
+    if(!trace.events || !trace.buffer){
+        raise_error("Failed allocation of `trace`.");
+    }
+    trace.pid = getpid();
+    n = snprintf(header, sizeof(header), "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"jshell\"}}", trace.pid);
+    if(write(trace.fd, header, n) < 0){
+        close(trace.fd);
+        trace.fd = -1;
     }
-    
-    pwd = getpwuid(getuid());
-    
-    gethostname(hostname, sizeof(hostname));
-    h = gethostbyname(hostname);
-    
-    printf("\n~%s@%s:%s ", pwd->pw_name, h->h_name, cwd);
-    printf(JSHELL_PROMPT);
-    
-    // free(h)?
 }
 
-// INPUT
-
-void jshell_loop(){
-    char *line;
-    char **args;
-
-    int ret_code;
+// Start of a span, 0 when tracing is off. That one load and branch is
+// all a span costs then.
+long long trace_begin(){
+    return trace.fd >= 0 ? trace_now() : 0;
+}
 
-    do {
-        show_prompt();
-        
-        line = jshell_read_line();
-        args = split_line(line);
+// Ends the span started at `start`. Any thread can record: a slot is
+// reserved with a compare-and-swap on head and published by storing its
+// sequence number. When the ring is full the span is dropped rather than
+// waited for, without reserving anything, so the flush never stalls on a
+// slot nobody fills. `detail` is copied, it can go right after the call.
+void trace_end(long long start, const char* name, const char* detail){
+    struct TraceEvent* event;
+    unsigned long slot;
+    pid_t tid;
 
-        ret_code = jshell_exec(args);
+    if(!start || trace.fd < 0){
+        return;
+    }
+    slot = __atomic_load_n(&trace.head, __ATOMIC_RELAXED);
+    do{
+        if(slot - __atomic_load_n(&trace.tail, __ATOMIC_ACQUIRE) >= JSHELL_TRACE_EVENTS){
+            __atomic_fetch_add(&trace.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&trace.head, &slot, slot + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    tid = syscall(SYS_gettid);
+    event = &trace.events[slot & (JSHELL_TRACE_EVENTS - 1)];
+    event->name = name;
+    event->start = start;
+    event->duration = trace_now() - start;
+    event->tid = tid;
+    snprintf(event->detail, sizeof(event->detail), "%s", detail ? detail : "");
+    __atomic_store_n(&event->seq, slot + 1, __ATOMIC_RELEASE);
 
-        free(line);
-        free_double_pointer((void**)args);
-    } while(ret_code!=JSHELL_EXIT_CODE);
+    // the main thread writes the ring out before it fills up
+    if(tid == trace.pid && slot - trace.tail >= JSHELL_TRACE_EVENTS/2){
+        trace_flush();
+    }
 }
 
-char* jshell_read_line(){
-    int buffer_size = JSHELL_LINE_BUFFER_SIZE;
-    int position = 0;
-    int c;
-    
-    char* line_buffer = malloc(buffer_size*sizeof(char));
-    if(!line_buffer){
-        raise_error("Failed allocation of `line_buffer`.");
-    }
-    
-    for(;;position++){
-        if(position >= buffer_size){
-            buffer_size += JSHELL_LINE_BUFFER_SIZE;
-            line_buffer = realloc(line_buffer, buffer_size);
-            if(!line_buffer){
-                raise_error("Failed allocation of `line_buffer`.");
-            }    
+// Appends `text` to the JSON buffer as a string body
+void trace_escape(size_t* n, const char* text){
+    for(; *text && *n < JSHELL_TRACE_BUFFER_SIZE - 8; text++){
+        if(*text == '"' || *text == '\\'){
+            trace.buffer[(*n)++] = '\\';
+            trace.buffer[(*n)++] = *text;
         }
-        
-        c = getchar();
-        
-        if(c==EOF || c=='\n'){
-            line_buffer[position] = '\0';
-            return line_buffer;
+        else if((unsigned char)*text < 0x20){
+            *n += snprintf(trace.buffer + *n, 8, "\\u%04x", *text);
         }
         else{
-            line_buffer[position] = c;
+            trace.buffer[(*n)++] = *text;
         }
     }
-    
 }
 
-// END INPUT
-
-// COMMANDS
+void trace_write(size_t n){
+    ssize_t written = 0;
+    ssize_t w;
 
-int jshell_run(char **args){
-    pid_t pid, wpid;
-    int status;
-    
-    pid = fork();
-    if(pid==0){
-        if(execvp(args[0], args) < 0){
-            char* err_msg = (char*)malloc(JSHELL_GENERIC_LIMIT*sizeof(char));
-            sprintf(err_msg, "jshell(\"%s\")", args[0]);
-            perror(err_msg);
+    while((size_t)written < n){
+        w = write(trace.fd, trace.buffer + written, n - written);
+        if(w < 0 && errno == EINTR){
+            continue;
         }
-        exit(EXIT_FAILURE);
+        if(w <= 0){
+            break;
+        }
+        written += w;
     }
-    else if(pid < 0){
-        perror("jshell");
+}
+
+// Writes out the events recorded so far, from the main thread. Each
+// buffer goes out in one O_APPEND write, so forked shells can share the file.
+void trace_flush(){
+    struct TraceEvent* event;
+    size_t n = 0;
+
+    if(trace.fd < 0){
+        return;
     }
-    else{
-        do{
-            wpid = waitpid(pid, &status, WUNTRACED);
-        } while(!WIFEXITED(status) && !WIFSIGNALED(status));
-        
+    for(;;){
+        event = &trace.events[trace.tail & (JSHELL_TRACE_EVENTS - 1)];
+        if(__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != trace.tail + 1){
+            // not recorded yet, or still being written
+            break;
+        }
+        if(n > JSHELL_TRACE_BUFFER_SIZE - 2*JSHELL_TRACE_DETAIL - 256){
+            trace_write(n);
+            n = 0;
+        }
+        n += snprintf(trace.buffer + n, JSHELL_TRACE_BUFFER_SIZE - n,
+                      ",\n{\"name\":\"%s\",\"cat\":\"jshell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"",
+                      event->name, event->start/1e3, event->duration/1e3, trace.pid, event->tid);
+        trace_escape(&n, event->detail);
+        n += snprintf(trace.buffer + n, JSHELL_TRACE_BUFFER_SIZE - n, "\"}}");
+        __atomic_store_n(&trace.tail, trace.tail + 1, __ATOMIC_RELEASE);
+    }
+    if(n){
+        trace_write(n);
     }
-    
-    return JSHELL_SUCCESS;
 }
 
-int jshell_cd(char **args){
-    if(args[1] == NULL) {
-        raise_error("Argument expected for 'cd' command");
-    } 
-    else {
-        if(chdir(args[1]) != 0) {
-            perror("jshell");
-        }
+// In a forked child: what the parent recorded is the parent's to write
+// out, the child's own spans go under its pid
+void trace_fork(){
+    if(trace.fd < 0){
+        return;
     }
-    return JSHELL_SUCCESS;
+    trace.pid = getpid();
+    trace.tail = trace.head;
 }
 
-int jshell_help(char **args){
-    int i;
-    printf("\nJShell\n\n");
-    printf("--Simple piping can be done through '|' character.\n");
-    printf("Usage: \"cmd1 arg0 arg1 ... | cmd2 arg0 arg1 ...\" (Support only for piping between 2 programs).\n\n");
-    printf("--Double quotes can be used for arguments containing delimiters.\n\n");
-    printf("The following commands are built in:\n");
+void trace_close(){
+    char footer[96];
+    int n;
 
-    int n_builtins = jshell_num_builtins();
-    for (i = 0; i < n_builtins; i++) {
-        printf("> %s\n", builtins[i].name);
+    if(trace.fd < 0){
+        return;
     }
-    printf("\n");
-    
-    return JSHELL_SUCCESS;
+    trace_flush();
+    if(trace.dropped){
+        fprintf(stderr, "jshell: trace: %lu spans dropped\n", trace.dropped);
+    }
+    n = snprintf(footer, sizeof(footer), "\n]\n");
+    if(write(trace.fd, footer, n) < 0){
+        fprintf(stderr, "jshell: trace: %s\n", strerror(errno));
+    }
+    close(trace.fd);
+    trace.fd = -1;
 }
 
-int jshell_exit(char **args){
-  return JSHELL_EXIT_CODE;
+// END TRACE
+
+// STARTUP
+
+// Every subsystem something may need is listed here and built the first
+// time it is, a `jshell -c true` pays for none of them
+struct Subsystem subsystems[] = {
+    { "env", &env_init, 0 },
+    { "builtins", &builtin_table_init, 0 },
+    { "jobs", &jobs_init, 0 },
+    { "prompt", &prompt_init, 0 },
+    { "completion", &completion_start, 0 },
+    { "topology", &topology_init, 0 },
+};
+
+struct Startup startup = { 0, 0, 0, 0, {{ NULL, 0, 0 }} };
+
+void subsystem_need(int id){
+    if(!subsystems[id].ready){
+        subsystem_start(id);
+    }
 }
 
-int jshell_exec_pipe(char **left_args, char **right_args){
-    int pipefd[2];  //0: read; 1: write
-    pid_t p1, p2, wpid1, wpid2;
-    int status1, status2;
-    
-    if(pipe(pipefd) < 0) {
-        fprintf(stderr, "jshell: Pipe could not be initialized.\n");
-        return JSHELL_FAILED;
+void startup_phase(const char* name, long long start){
+    long long now = trace_now();
+
+    if(startup.n_phases < JSHELL_STARTUP_PHASES){
+        startup.phases[startup.n_phases].name = name;
+        startup.phases[startup.n_phases].at = start - startup.origin;
+        startup.phases[startup.n_phases].took = now - start;
+        startup.n_phases++;
     }
-    p1 = fork();
-    if(p1 < 0) {
-        fprintf(stderr, "jshell: Fork failed.\n");
-        return JSHELL_FAILED;
+}
+
+void subsystem_start(int id){
+    long long start = startup.profile ? trace_now() : 0;
+    long long span = trace_begin();
+
+    // ready first, initialization may go through the subsystem's own calls
+    subsystems[id].ready = 1;
+    (*subsystems[id].init)();
+    trace_end(span, subsystems[id].name, NULL);
+    if(startup.profile){
+        startup_phase(subsystems[id].name, start);
     }
-    
-    else if(p1 == 0) {
-        // close read end
-        close(pipefd[0]);
+}
+
+// The first command is done. What's been built up to here is what a
+// one-off invocation costs, later lazy starts are listed too.
+void startup_first_command(long long start){
+    startup.first = 0;
+    startup_phase("first command", start);
+}
+
+// --startup-profile report, times since main() in ms. Phases are listed
+// by when they started, what a command built comes right after it.
+void startup_report(){
+    struct StartupPhase phase;
+    int i, j;
+
+    for(i=1; i<startup.n_phases; i++){
+        phase = startup.phases[i];
+        for(j=i; j>0 && startup.phases[j-1].at > phase.at; j--){
+            startup.phases[j] = startup.phases[j-1];
+        }
+        startup.phases[j] = phase;
+    }
+
+    fprintf(stderr, "%-16s %10s %10s\n", "startup (ms)", "at", "took");
+    for(i=0; i<startup.n_phases; i++){
+        fprintf(stderr, "%-16s %10.3f %10.3f\n", startup.phases[i].name,
+                startup.phases[i].at/1e6, startup.phases[i].took/1e6);
+    }
+    fprintf(stderr, "%-16s %10.3f\n", "exit", (trace_now() - startup.origin)/1e6);
+}
+
+// END STARTUP
+
+// PARSING
+
+int is_delimiter(char c){
+
+    if(c == ' '  ||
+       c == '\t' ||
+       c == '\r' ||
+       c == '\n' ||
+       c == '\a')
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+int is_operator(char c){
+    return c == JSHELL_PIPE[0] || c == JSHELL_BACKGROUND[0] ||
+           c == JSHELL_REDIRECT_IN[0] || c == JSHELL_REDIRECT_OUT[0];
+}
+
+// Operator tokens are returned as these pointers, not as words in the line
+char jshell_op_pipe[] = JSHELL_PIPE;
+char jshell_op_background[] = JSHELL_BACKGROUND;
+char jshell_op_in[] = JSHELL_REDIRECT_IN;
+char jshell_op_out[] = JSHELL_REDIRECT_OUT;
+char jshell_op_append[] = JSHELL_REDIRECT_APPEND;
+char jshell_op_err[] = JSHELL_REDIRECT_ERR;
+char jshell_op_err_append[] = JSHELL_REDIRECT_ERR_APPEND;
+char jshell_op_err_out[] = JSHELL_REDIRECT_ERR_OUT;
+
+int is_operator_token(const char* token){
+    return token == jshell_op_pipe || token == jshell_op_background ||
+           token == jshell_op_in || token == jshell_op_out || token == jshell_op_append ||
+           token == jshell_op_err || token == jshell_op_err_append || token == jshell_op_err_out;
+}
+
+// Operator starting at line[*i], *i is left on its last character.
+// `err` means it was preceded by a lone 2, as in 2> and 2>&1.
+char* split_operator(char* line, size_t* i, int err){
+    char c = line[*i];
+
+    if(c == JSHELL_PIPE[0]){
+        return jshell_op_pipe;
+    }
+    if(c == JSHELL_BACKGROUND[0]){
+        return jshell_op_background;
+    }
+    if(c == JSHELL_REDIRECT_IN[0]){
+        return jshell_op_in;
+    }
+    if(line[*i+1] == '>'){
+        (*i)++;
+        return err ? jshell_op_err_append : jshell_op_append;
+    }
+    if(err && line[*i+1] == '&' && line[*i+2] == '1'){
+        *i += 2;
+        return jshell_op_err_out;
+    }
+    return err ? jshell_op_err : jshell_op_out;
+}
+
+// Index of the ')' closing the $( whose body starts at line[start], 0 when
+// it isn't closed. Parentheses in quotes don't count.
+size_t substitution_end(const char* line, size_t start){
+    char in_quotes = 0;
+    int depth = 0;
+    size_t i;
+
+    for(i=start; line[i]; i++){
+        if(in_quotes){
+            in_quotes = line[i] == in_quotes ? 0 : in_quotes;
+        }
+        else if(line[i] == '"' || line[i] == '\''){
+            in_quotes = line[i];
+        }
+        else if(line[i] == '('){
+            depth++;
+        }
+        else if(line[i] == ')' && depth-- == 0){
+            return i;
+        }
+    }
+    return 0;
+}
+
+int split_globbed = 0;    // the last split_line() expanded a pattern, its words depend on the file system
+
+// Replaces the last token, an unquoted pattern, with the paths it matches
+char** split_glob(char** tokens, size_t* max_tokens, int* current_token){
+    char* pattern = tokens[*current_token - 1];
+    char** paths;
+    char** grown;
+    int count;
+
+    if(!glob_has_meta(pattern, pattern + strlen(pattern))){
+        return tokens;
+    }
+    split_globbed = 1;
+    paths = glob_expand(pattern, &count);
+    if(!paths){
+        return tokens;
+    }
+    if(count > 1){
+        grown = arena_alloc(&jshell_arena, (*max_tokens + count - 1)*sizeof(char*));
+        memcpy(grown, tokens, (*current_token - 1)*sizeof(char*));
+        tokens = grown;
+        *max_tokens += count - 1;
+    }
+    memcpy(tokens + *current_token - 1, paths, count*sizeof(char*));
+    *current_token += count - 1;
+    return tokens;
+}
+
+// Tokens are unquoted and NUL terminated in place, `line` is overwritten and
+// the returned array points into it. Lines with $ references are written
+// to a buffer of their expanded size instead, the values are inserted as
+// they are, never split or tokenized again. The output of $(...) is split
+// into words unless it's quoted. Unquoted *, ? and [...] make the word a
+// pattern, replaced by the paths it matches. Nothing is expanded in single
+// quotes. Malformed quoting is reported and makes it return NULL.
+char** split_line(char *line){
+    // operators need no delimiter, so every byte may start a token
+    size_t max_tokens = strlen(line) + 1;
+    int current_token = 0;
+
+    char in_quotes = 0;    // the open quote character
+    int quoted = 0;        // the word had quotes, so it stays even when empty
+    int globbing = 0;      // the word has unquoted pattern characters
+    int glob_quoted = 0;   // and quoted ones, which can't be told apart anymore
+    int at_end;
+    int err;
+    char* op;
+    char* out = line;
+    const char* value;
+    char* output;
+    char* grown;
+    char** more;
+    size_t size = max_tokens;
+    size_t consumed;
+    size_t length;
+    size_t i, j, k, token_start, end;
+    long long span = trace_begin();
+    long long substitution_span;
+
+    char** tokens = arena_alloc(&jshell_arena, max_tokens*sizeof(char*));
+
+    split_globbed = 0;
+    if(strchr(line, '$')){
+        // every reference counts, quoted or not, so the size is an upper bound
+        for(i=0; line[i]; i++){
+            if(line[i] == '$' && (value = expand_ref(line + i + 1, &consumed)) != NULL){
+                size += strlen(value);
+            }
+        }
+        out = arena_alloc(&jshell_arena, size);
+    }
+
+    for(i=0, j=0, token_start=0;; i++){
+        if(line[i] == '\0')
+            goto End_token;
+
+        if(line[i] == '"' || line[i] == '\''){
+
+            if(!in_quotes){
+                in_quotes = line[i];
+                quoted = 1;
+                continue;
+            }
+            else if(in_quotes == line[i]){
+                if(!is_delimiter(line[i+1]) && !is_operator(line[i+1]) && line[i+1]!='\0'){
+                    fprintf(stderr, "jshell: Expected delimiter after end quote.\n");
+                    trace_end(span, "split_line", NULL);
+                    return NULL;
+                }
+
+                in_quotes = 0;
+                if(!is_operator(line[i+1])){
+                    i++;  // skip to delimiter after end quote
+                }
+                goto End_token;
+            }
+        }
+
+        if(line[i] == '$' && line[i+1] == '(' && in_quotes != '\''){
+            end = substitution_end(line, i + 2);
+            if(!end){
+                fprintf(stderr, "jshell: Expected ')' after command substitution.\n");
+                trace_end(span, "split_line", NULL);
+                return NULL;
+            }
+            substitution_span = trace_begin();
+            output = jshell_capture(line + i + 2, end - i - 2, &length);
+            trace_end(substitution_span, "capture", NULL);
+
+            // output sizes aren't known upfront. The word so far moves to a
+            // buffer with room for it too, earlier tokens stay where they are.
+            grown = arena_alloc(&jshell_arena, size - token_start + length);
+            memcpy(grown, out + token_start, j - token_start);
+            size = size - token_start + length;
+            j -= token_start;
+            token_start = 0;
+            out = grown;
+            if(!in_quotes){
+                more = arena_alloc(&jshell_arena, (max_tokens + length/2 + 1)*sizeof(char*));
+                memcpy(more, tokens, current_token*sizeof(char*));
+                tokens = more;
+                max_tokens += length/2 + 1;
+            }
+
+            for(k=0; k<length; k++){
+                if(in_quotes || !is_delimiter(output[k])){
+                    out[j++] = output[k];
+                }
+                else if(j > token_start){
+                    out[j++] = '\0';
+                    tokens[current_token++] = out + token_start;
+                    if(globbing && !glob_quoted){
+                        tokens = split_glob(tokens, &max_tokens, &current_token);
+                    }
+                    globbing = glob_quoted = 0;
+                    token_start = j;
+                }
+            }
+            free(output);
+            i = end;
+            continue;
+        }
+
+        if(line[i] == '$' && in_quotes != '\''){
+            value = expand_ref(line + i + 1, &consumed);
+            if(consumed){
+                if(value){
+                    strcpy(out + j, value);
+                    j += strlen(value);
+                }
+                i += consumed;
+                continue;
+            }
+        }
+
+        if(line[i] == '#' && j == token_start && !in_quotes)
+            goto End_token;
+
+        // if character is not delimiter, add to token and move on
+        // (in place j never passes i, so unquoting can shift the word left)
+        if(in_quotes || (!is_delimiter(line[i]) && !is_operator(line[i]))){
+            if(line[i] == '*' || line[i] == '?' || line[i] == '['){
+                glob_quoted |= in_quotes != 0;
+                globbing |= !in_quotes;
+            }
+            out[j] = line[i];
+            j++;
+        }
+        else{
+            End_token:
+
+            at_end = line[i] == '\0';
+
+            if(is_operator(line[i]) && !in_quotes){
+                // an unquoted 2 right before '>' is part of the operator
+                err = line[i] == '>' && j == token_start + 1 && out[token_start] == '2' && line[i-1] == '2';
+                if(err){
+                    j = token_start;
+                }
+                // read before the word's NUL, which may land on the operator
+                op = split_operator(line, &i, err);
+                if(j > token_start){
+                    out[j++] = '\0';
+                    tokens[current_token++] = out + token_start;
+                    if(globbing && !glob_quoted){
+                        tokens = split_glob(tokens, &max_tokens, &current_token);
+                    }
+                    globbing = glob_quoted = 0;
+                    token_start = j;
+                }
+                tokens[current_token++] = op;
+                continue;
+            }
+
+            if(j == token_start && line[i] == '#' && !in_quotes){
+                // comment, drop the rest of the line
+                line[i] = '\0';
+                at_end = 1;
+            }
+
+            if(j == token_start && !quoted)
+            {
+                // if token is empty and EOF, just end parsing
+                if(at_end)
+                    break;
+                // if not, skip to next character
+                else
+                    continue;
+            }
+
+            out[j] = '\0';
+            tokens[current_token++] = out + token_start;
+            if(globbing && !glob_quoted){
+                tokens = split_glob(tokens, &max_tokens, &current_token);
+            }
+            globbing = glob_quoted = quoted = 0;
+
+            j++;
+            token_start = j;
+
+            if(at_end){
+                break;
+            }
+        }
+
+    }
+
+    if(in_quotes){
+        fprintf(stderr, "jshell: Parsing ended unexpectedly.\n");
+        trace_end(span, "split_line", NULL);
+        return NULL;
+    }
+
+    tokens[current_token] = NULL;
+    trace_end(span, "split_line", NULL);
+    return tokens;
+}
+
+// END PARSING
+
+// JSHELL
+
+// PROMPT
+
+char prompt_user[JSHELL_GENERIC_LIMIT];
+char prompt_host[JSHELL_GENERIC_LIMIT];
+char prompt_buffer[PATH_MAX + 2*JSHELL_GENERIC_LIMIT];
+int prompt_length = 0;
+
+void prompt_init(){
+    struct passwd* pwd;
+    struct hostent* h;
+
+    pwd = getpwuid(getuid());
+    snprintf(prompt_user, sizeof(prompt_user), "%s", pwd ? pwd->pw_name : "?");
+
+    if(gethostname(prompt_host, sizeof(prompt_host)) != 0){
+        strcpy(prompt_host, "localhost");
+    }
+    prompt_host[sizeof(prompt_host)-1] = '\0';
+
+    // may go through NSS/DNS, so it is only ever done once
+    h = gethostbyname(prompt_host);
+    if(h != NULL){
+        snprintf(prompt_host, sizeof(prompt_host), "%s", h->h_name);
+    }
+
+    prompt_refresh_cwd();
+}
+
+void prompt_refresh_cwd(){
+    char cwd[PATH_MAX];
+
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        perror("getcwd() error");
+        strcpy(cwd, "?");
+    }
+
+    prompt_length = snprintf(prompt_buffer, sizeof(prompt_buffer),
+                             "\n~%s@%s:%s " JSHELL_PROMPT, prompt_user, prompt_host, cwd);
+    if(prompt_length >= (int)sizeof(prompt_buffer)){
+        prompt_length = sizeof(prompt_buffer) - 1;
+    }
+}
+
+void show_prompt(){
+    fwrite(prompt_buffer, 1, prompt_length, stdout);
+    fflush(stdout);
+}
+
+// END PROMPT
+
+// INPUT
+
+struct Reader jshell_reader = { STDIN_FILENO, NULL, 0, 0, 0, 0 };
+int jshell_interactive = 0;
+int jshell_status = 0;    // exit status of the last command
+
+void jshell_loop(){
+    char detail[JSHELL_TRACE_DETAIL];
+    long long start = 0;
+    long long span;
+    char *line;
+    int ret_code;
+
+    do {
+        arena_reset(&jshell_arena);
+        jobs_reap(0);
+        jobs_notify();
+        // a line's spans are in the file by the time its prompt is back
+        trace_flush();
+        if(jshell_interactive){
+            show_prompt();
+        }
+
+        span = trace_begin();
+        line = jshell_interactive ? editor_read_line() : jshell_read_line();
+        trace_end(span, "read_line", NULL);
+        if(line == NULL){
+            // end of input
+            break;
+        }
+        if(jshell_interactive){
+            // before the tokenizer overwrites it
+            history_add(line);
+        }
+        span = trace_begin();
+        if(span){
+            snprintf(detail, sizeof(detail), "%s", line);
+        }
+        if(startup.first){
+            start = trace_now();
+        }
+        ret_code = jshell_run_source(line);
+        trace_end(span, "line", detail);
+        if(startup.first){
+            startup_first_command(start);
+        }
+    } while(ret_code!=JSHELL_EXIT_CODE);
+}
+
+// Background jobs ended at a prompt without the line editor, what was
+// typed so far stays with the terminal
+void reader_notify(){
+    printf("\n");
+    jobs_notify();
+    show_prompt();
+}
+
+// Returns the next line, NUL terminated in place inside the reader buffer.
+// It stays valid until the following call; NULL means end of input.
+char* jshell_read_line(){
+    struct Reader* r = &jshell_reader;
+    size_t scanned = 0;
+    char* newline;
+    char* line;
+    ssize_t n;
+
+    for(;;){
+        newline = NULL;
+        if(r->end > r->start + scanned){
+            newline = memchr(r->buffer + r->start + scanned, '\n', r->end - r->start - scanned);
+        }
+
+        if(newline){
+            *newline = '\0';
+            line = r->buffer + r->start;
+            r->start = newline - r->buffer + 1;
+            return line;
+        }
+        scanned = r->end - r->start;
+
+        if(r->eof){
+            if(r->start == r->end){
+                return NULL;
+            }
+            // last line has no newline, read buffers always have room for the
+            // terminator, a mapped script may not
+            if(r->end < r->capacity){
+                r->buffer[r->end] = '\0';
+                line = r->buffer + r->start;
+            }
+            else{
+                line = arena_alloc(&jshell_arena, r->end - r->start + 1);
+                memcpy(line, r->buffer + r->start, r->end - r->start);
+                line[r->end - r->start] = '\0';
+            }
+            r->start = r->end;
+            return line;
+        }
+
+        // move the partial line to the front, grow only if it still doesn't fit
+        if(r->start > 0){
+            memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if(r->capacity - r->end <= JSHELL_LINE_BUFFER_SIZE){
+            r->capacity = r->capacity ? 2*r->capacity : JSHELL_READ_BUFFER_SIZE;
+            r->buffer = realloc(r->buffer, r->capacity);
+            if(!r->buffer){
+                raise_error("Failed allocation of `reader buffer`.");
+            }
+        }
+
+        if(jshell_interactive){
+            input_wait(r->fd, reader_notify);
+        }
+        n = read(r->fd, r->buffer + r->end, r->capacity - r->end - 1);
+        if(n > 0){
+            r->end += n;
+        }
+        else if(n == 0){
+            r->eof = 1;
+        }
+        else if(errno != EINTR){
+            perror("jshell");
+            r->eof = 1;
+        }
+    }
+}
+
+// The script is mapped privately, so lines are split and tokenized in place
+// without ever being copied out of the page cache.
+int reader_open_script(const char* path){
+    struct stat st;
+    char* map = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0){
+        perror(path);
+        if(fd >= 0){
+            close(fd);
+        }
+        return JSHELL_FAILED;
+    }
+
+    if(st.st_size > 0){
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED){
+            perror(path);
+            close(fd);
+            return JSHELL_FAILED;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    jshell_reader.fd = -1;
+    jshell_reader.buffer = map;
+    jshell_reader.capacity = st.st_size;
+    jshell_reader.start = 0;
+    jshell_reader.end = st.st_size;
+    jshell_reader.eof = 1;
+    return JSHELL_SUCCESS;
+}
+
+void reader_open_string(char* string){
+    jshell_reader.fd = -1;
+    jshell_reader.buffer = string;
+    jshell_reader.end = strlen(string);
+    jshell_reader.capacity = jshell_reader.end + 1;    // its own terminator
+    jshell_reader.start = 0;
+    jshell_reader.eof = 1;
+}
+
+// END INPUT
+
+// PATH CACHE
+
+struct PathCache path_cache = { NULL, 0, 0, NULL, 0 };
+
+void path_cache_clear(){
+    size_t i;
+
+    for(i=0; i<path_cache.capacity; i++){
+        free(path_cache.entries[i].name);
+        free(path_cache.entries[i].path);
+    }
+    free(path_cache.entries);
+    free(path_cache.path_env);
+    path_cache.entries = NULL;
+    path_cache.capacity = 0;
+    path_cache.count = 0;
+    path_cache.path_env = NULL;
+    path_cache.generation++;
+}
+
+struct PathEntry* path_cache_slot(const char* name){
+    size_t mask = path_cache.capacity - 1;
+    size_t i = jshell_hash(name, strlen(name)) & mask;
+
+    while(path_cache.entries[i].name && strcmp(path_cache.entries[i].name, name) != 0){
+        i = (i + 1) & mask;
+    }
+    return &path_cache.entries[i];
+}
+
+void path_cache_insert(char* name, char* path, unsigned int hits){
+    struct PathEntry* old_entries = path_cache.entries;
+    size_t old_capacity = path_cache.capacity;
+    struct PathEntry* slot;
+    size_t i;
+
+    if(2*(path_cache.count + 1) > path_cache.capacity){
+        path_cache.capacity = old_capacity ? 2*old_capacity : JSHELL_PATH_CACHE_SIZE;
+        path_cache.entries = calloc(path_cache.capacity, sizeof(struct PathEntry));
+        if(!path_cache.entries){
+            raise_error("Failed allocation of `path cache`.");
+        }
+        path_cache.count = 0;
+        for(i=0; i<old_capacity; i++){
+            if(old_entries[i].name){
+                path_cache_insert(old_entries[i].name, old_entries[i].path, old_entries[i].hits);
+            }
+        }
+        free(old_entries);
+    }
+
+    slot = path_cache_slot(name);
+    slot->name = name;
+    slot->path = path;
+    slot->hits = hits;
+    path_cache.count++;
+}
+
+void path_cache_forget(const char* name){
+    size_t mask = path_cache.capacity - 1;
+    size_t i, j, home;
+    struct PathEntry* slot;
+
+    if(!path_cache.capacity){
+        return;
+    }
+    slot = path_cache_slot(name);
+    if(!slot->name){
+        return;
+    }
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL;
+    path_cache.count--;
+    path_cache.generation++;
+
+    // shift the rest of the probe run back so lookups never stop early
+    i = slot - path_cache.entries;
+    for(j = (i + 1) & mask; path_cache.entries[j].name; j = (j + 1) & mask){
+        home = jshell_hash(path_cache.entries[j].name, strlen(path_cache.entries[j].name)) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            path_cache.entries[i] = path_cache.entries[j];
+            path_cache.entries[j].name = NULL;
+            i = j;
+        }
+    }
+}
+
+// Returns the executable `name` resolves to, NULL if PATH has none.
+// Names containing '/' are used as they are.
+const char* path_cache_lookup(const char* name){
+    const char* path_env = env_get("PATH");
+    const char* dir;
+    const char* dir_end;
+    struct PathEntry* slot;
+    struct stat st;
+    char full[PATH_MAX];
+    size_t dir_length;
+
+    if(strchr(name, '/')){
+        return name;
+    }
+    if(!path_env){
+        path_env = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    // env_set() clears the cache whenever PATH changes
+    if(!path_cache.path_env){
+        path_cache_clear();
+        path_cache.path_env = strdup(path_env);
+    }
+    else if(path_cache.capacity){
+        slot = path_cache_slot(name);
+        if(slot->name){
+            slot->hits++;
+            return slot->path;
+        }
+    }
+
+    for(dir = path_env;; dir = dir_end + 1){
+        dir_end = strchrnul(dir, ':');
+        dir_length = dir_end - dir;
+
+        // an empty PATH entry means the current directory
+        if(dir_length == 0){
+            snprintf(full, sizeof(full), "./%s", name);
+        }
+        else{
+            snprintf(full, sizeof(full), "%.*s/%s", (int)dir_length, dir, name);
+        }
+
+        if(stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0){
+            path_cache_insert(strdup(name), strdup(full), 1);
+            return path_cache_slot(name)->path;
+        }
+
+        if(*dir_end == '\0'){
+            return NULL;
+        }
+    }
+}
+
+// END PATH CACHE
+
+// GLOB
+
+struct GlobCache glob_cache;
+
+void glob_cache_clear(){
+    int i;
+
+    for(i=0; i<JSHELL_GLOB_CACHE_SIZE; i++){
+        free(glob_cache.dirs[i].names);
+        free(glob_cache.dirs[i].data);
+    }
+    memset(glob_cache.dirs, 0, sizeof(glob_cache.dirs));
+    glob_cache.count = 0;
+}
+
+int glob_name_compare(const void* a, const void* b){
+    return strcmp(((const struct GlobName*)a)->name, ((const struct GlobName*)b)->name);
+}
+
+// Reads and sorts the listing of `path` into `dir`, with malloc'd memory
+// for the cache or arena memory for a one-off listing
+int glob_dir_read(struct GlobDir* dir, const char* path, int cached){
+    struct dirent* entry;
+    struct timespec now;
+    size_t size = 0, capacity = 0, used = 0;
+    size_t length;
+    int n_names = 0;
+    char* data = NULL;
+    DIR* d;
+    int i;
+
+    d = opendir(path);
+    if(!d){
+        return -1;
+    }
+    // names are collected first, the pointers are taken once `data` stops moving
+    while((entry = readdir(d))){
+        if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))){
+            continue;
+        }
+        length = strlen(entry->d_name) + 2;    // type byte and NUL
+        if(size + length > capacity){
+            capacity = capacity ? 2*capacity : JSHELL_READ_BUFFER_SIZE;
+            while(size + length > capacity){
+                capacity *= 2;
+            }
+            data = realloc(data, capacity);
+            if(!data){
+                raise_error("Failed allocation of `directory listing`.");
+            }
+        }
+        data[size] = entry->d_type;
+        memcpy(data + size + 1, entry->d_name, length - 1);
+        size += length;
+        n_names++;
+    }
+    closedir(d);
+
+    dir->count = n_names;
+    dir->names = cached ? malloc((n_names + 1)*sizeof(struct GlobName)) : arena_alloc(&jshell_arena, (n_names + 1)*sizeof(struct GlobName));
+    if(!dir->names){
+        raise_error("Failed allocation of `directory listing`.");
+    }
+    if(!cached && data){
+        dir->data = memcpy(arena_alloc(&jshell_arena, size), data, size);
+        free(data);
+    }
+    else{
+        dir->data = data;
+    }
+    for(i=0; i<n_names; i++){
+        dir->names[i].type = (unsigned char)dir->data[used];
+        dir->names[i].name = dir->data + used + 1;
+        used += strlen(dir->names[i].name) + 2;
+    }
+    qsort(dir->names, n_names, sizeof(struct GlobName), glob_name_compare);
+
+    // a change in the same mtime tick as the listing wouldn't move the mtime
+    clock_gettime(CLOCK_REALTIME, &now);
+    if((now.tv_sec - dir->mtime.tv_sec)*1000000000LL + (now.tv_nsec - dir->mtime.tv_nsec) < JSHELL_GLOB_RACY_NS){
+        dir->mtime.tv_sec = -1;
+    }
+    return 0;
+}
+
+// Sorted listing of the directory `path`. It comes from the cache when
+// the directory's mtime hasn't moved since it was read, one stat instead
+// of a readdir pass.
+struct GlobDir* glob_dir(const char* path){
+    struct GlobDir* dir;
+    struct stat st;
+    size_t mask = JSHELL_GLOB_CACHE_SIZE - 1;
+    size_t i;
+    unsigned long long key[2];
+
+    if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode)){
+        return NULL;
+    }
+    key[0] = st.st_dev;
+    key[1] = st.st_ino;
+    i = jshell_hash((const char*)key, sizeof(key)) & mask;
+    while(glob_cache.dirs[i].ino && !(glob_cache.dirs[i].ino == st.st_ino && glob_cache.dirs[i].dev == st.st_dev)){
+        i = (i + 1) & mask;
+    }
+    dir = &glob_cache.dirs[i];
+
+    if(dir->ino && dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec){
+        glob_cache.hits++;
+        return dir;
+    }
+    glob_cache.misses++;
+
+    if(!dir->ino && 2*(glob_cache.count + 1) > JSHELL_GLOB_CACHE_SIZE){
+        // full, the listing only lives for this command. glob_expand()
+        // makes room before the next one.
+        dir = arena_alloc(&jshell_arena, sizeof(struct GlobDir));
+        dir->mtime = st.st_mtim;
+        return glob_dir_read(dir, path, 0) == 0 ? dir : NULL;
+    }
+
+    if(dir->ino){
+        free(dir->names);
+        free(dir->data);
+    }
+    else{
+        glob_cache.count++;
+    }
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    if(glob_dir_read(dir, path, 1) < 0){
+        // keep the slot, an unreadable directory is a stale entry next time
+        dir->names = NULL;
+        dir->data = NULL;
+        dir->count = 0;
+        dir->mtime.tv_sec = -1;
+        return NULL;
+    }
+    return dir;
+}
+
+// End of the [...] class at `pattern`, NULL when it isn't closed
+const char* glob_class_end(const char* pattern, const char* end){
+    const char* p = pattern + 1;
+
+    if(p < end && (*p == '!' || *p == '^')){
+        p++;
+    }
+    if(p < end && *p == ']'){
+        p++;    // a leading ] is a literal one
+    }
+    while(p < end && *p != ']'){
+        p++;
+    }
+    return p < end ? p : NULL;
+}
+
+int glob_has_meta(const char* pattern, const char* end){
+    const char* p;
+
+    for(p=pattern; p<end; p++){
+        if(*p == '*' || *p == '?' || (*p == '[' && glob_class_end(p, end))){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Compiles the component [pattern, end) once, it's matched against every
+// name of a directory
+struct GlobOp* glob_compile(const char* pattern, const char* end, int* n_ops){
+    struct GlobOp* ops = arena_alloc(&jshell_arena, (end - pattern + 1)*sizeof(struct GlobOp));
+    const char* p = pattern;
+    const char* close;
+    struct GlobOp* op;
+    int negate, c;
+    int n = 0;
+
+    while(p < end){
+        op = &ops[n];
+        memset(op, 0, sizeof(*op));
+        if(*p == '*'){
+            // a run of stars is one
+            if(!n || ops[n-1].type != GLOB_STAR){
+                op->type = GLOB_STAR;
+                n++;
+            }
+            p++;
+            continue;
+        }
+        if(*p == '?'){
+            op->type = GLOB_ANY;
+            n++;
+            p++;
+            continue;
+        }
+        if(*p == '[' && (close = glob_class_end(p, end))){
+            op->type = GLOB_CLASS;
+            p++;
+            negate = *p == '!' || *p == '^';
+            p += negate;
+            do{
+                if(p + 2 < close && p[1] == '-'){
+                    for(c=(unsigned char)p[0]; c<=(unsigned char)p[2]; c++){
+                        op->set[c >> 3] |= 1 << (c & 7);
+                    }
+                    p += 3;
+                }
+                else{
+                    op->set[(unsigned char)*p >> 3] |= 1 << (*p & 7);
+                    p++;
+                }
+            }while(p < close);
+            if(negate){
+                for(c=0; c<32; c++){
+                    op->set[c] = ~op->set[c];
+                }
+            }
+            p = close + 1;
+            n++;
+            continue;
+        }
+        op->type = GLOB_LITERAL;
+        op->literal = p;
+        while(p < end && *p != '*' && *p != '?' && !(*p == '[' && glob_class_end(p, end))){
+            p++;
+        }
+        op->length = p - op->literal;
+        n++;
+    }
+    *n_ops = n;
+    return ops;
+}
+
+// Only the last star ever needs to take more characters, anything an
+// earlier one could take the last one can take too
+int glob_match(struct GlobOp* ops, int n_ops, const char* name){
+    size_t length = strlen(name);
+    size_t s = 0, star_s = 0;
+    int p = 0, star_p = -1;
+    struct GlobOp* op;
+
+    while(s < length || p < n_ops){
+        if(p < n_ops){
+            op = &ops[p];
+            if(op->type == GLOB_STAR){
+                star_p = ++p;
+                star_s = s;
+                continue;
+            }
+            if(op->type == GLOB_ANY && s < length){
+                p++;
+                s++;
+                continue;
+            }
+            if(op->type == GLOB_CLASS && s < length && (op->set[(unsigned char)name[s] >> 3] & (1 << (name[s] & 7)))){
+                p++;
+                s++;
+                continue;
+            }
+            if(op->type == GLOB_LITERAL && length - s >= op->length && memcmp(name + s, op->literal, op->length) == 0){
+                p++;
+                s += op->length;
+                continue;
+            }
+        }
+        if(star_p >= 0 && star_s < length){
+            p = star_p;
+            s = ++star_s;
+            continue;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+struct GlobResult {
+    char** paths;
+    int count;
+    int capacity;
+};
+
+void glob_add(struct GlobResult* result, const char* path, size_t length){
+    char** grown;
+
+    if(result->count == result->capacity){
+        result->capacity = result->capacity ? 2*result->capacity : JSHELL_GENERIC_LIMIT/16;
+        grown = arena_alloc(&jshell_arena, result->capacity*sizeof(char*));
+        if(result->count){
+            memcpy(grown, result->paths, result->count*sizeof(char*));
+        }
+        result->paths = grown;
+    }
+    result->paths[result->count] = arena_alloc(&jshell_arena, length + 1);
+    memcpy(result->paths[result->count], path, length);
+    result->paths[result->count++][length] = '\0';
+}
+
+// Matches `pattern` one component at a time below path[0, length), which
+// is empty or ends in a slash
+void glob_walk(struct GlobResult* result, char* path, size_t length, const char* pattern){
+    struct GlobDir* dir;
+    struct GlobOp* ops;
+    struct stat st;
+    const char* end;
+    size_t name_length;
+    int n_ops, i;
+
+    while(*pattern == '/' && length + 1 < PATH_MAX){
+        path[length++] = *pattern++;
+    }
+    if(*pattern == '\0'){
+        glob_add(result, path, length);
+        return;
+    }
+    end = strchrnul(pattern, '/');
+
+    if(!glob_has_meta(pattern, end)){
+        if(length + (end - pattern) >= PATH_MAX){
+            return;
+        }
+        memcpy(path + length, pattern, end - pattern);
+        length += end - pattern;
+        path[length] = '\0';
+        if(*end == '\0'){
+            if(lstat(path, &st) == 0){
+                glob_add(result, path, length);
+            }
+            return;
+        }
+        glob_walk(result, path, length, end);
+        return;
+    }
+
+    path[length] = '\0';
+    dir = glob_dir(length ? path : ".");
+    if(!dir){
+        return;
+    }
+    ops = glob_compile(pattern, end, &n_ops);
+    for(i=0; i<dir->count; i++){
+        // hidden files only match a pattern that starts with a dot
+        if(dir->names[i].name[0] == '.' && *pattern != '.'){
+            continue;
+        }
+        if(!glob_match(ops, n_ops, dir->names[i].name)){
+            continue;
+        }
+        name_length = strlen(dir->names[i].name);
+        if(length + name_length + 1 >= PATH_MAX){
+            continue;
+        }
+        memcpy(path + length, dir->names[i].name, name_length + 1);
+        if(*end == '\0'){
+            glob_add(result, path, length + name_length);
+            continue;
+        }
+        if(dir->names[i].type == DT_DIR ||
+           ((dir->names[i].type == DT_LNK || dir->names[i].type == DT_UNKNOWN) && stat(path, &st) == 0 && S_ISDIR(st.st_mode))){
+            glob_walk(result, path, length + name_length, end);
+        }
+    }
+}
+
+// Paths matching `pattern`, sorted one component at a time. NULL when
+// nothing matches, the word is then kept as it is.
+char** glob_expand(const char* pattern, int* count){
+    struct GlobResult result = { NULL, 0, 0 };
+    char path[PATH_MAX];
+
+    if(2*glob_cache.count >= JSHELL_GLOB_CACHE_SIZE){
+        glob_cache_clear();
+    }
+    glob_walk(&result, path, 0, pattern);
+    *count = result.count;
+    return result.count ? result.paths : NULL;
+}
+
+// END GLOB
+
+// ENVIRONMENT
+
+struct Env env = { NULL, 0, 0, NULL, 1 };
+
+struct EnvEntry* env_slot(const char* name, size_t length){
+    size_t mask = env.capacity - 1;
+    size_t i = jshell_hash(name, length) & mask;
+
+    while(env.entries[i].pair && (env.entries[i].name_length != length
+                                  || memcmp(env.entries[i].pair, name, length) != 0)){
+        i = (i + 1) & mask;
+    }
+    return &env.entries[i];
+}
+
+void env_grow(){
+    struct EnvEntry* old = env.entries;
+    size_t old_capacity = env.capacity;
+    size_t i;
+
+    env.capacity = old_capacity ? 2*old_capacity : JSHELL_ENV_SIZE;
+    env.entries = calloc(env.capacity, sizeof(struct EnvEntry));
+    if(!env.entries){
+        raise_error("Failed allocation of `environment`.");
+    }
+    for(i=0; i<old_capacity; i++){
+        if(old[i].pair){
+            *env_slot(old[i].pair, old[i].name_length) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Takes over the environment the shell was started with, all exported
+void env_init(){
+    char** e;
+    char* equals;
+
+    for(e=environ; *e; e++){
+        equals = strchr(*e, '=');
+        if(equals){
+            env_set(*e, equals - *e, equals + 1, 1);
+        }
+    }
+}
+
+const char* env_get(const char* name){
+    size_t length = strlen(name);
+    struct EnvEntry* slot;
+
+    subsystem_need(SUBSYSTEM_ENV);
+    if(!env.capacity){
+        return NULL;
+    }
+    slot = env_slot(name, length);
+    return slot->pair ? slot->pair + length + 1 : NULL;
+}
+
+// Sets the variable, exporting it when `exported` is set. A variable that
+// is already exported stays so.
+void env_set(const char* name, size_t name_length, const char* value, int exported){
+    struct EnvEntry* slot;
+    size_t value_length = strlen(value);
+
+    subsystem_need(SUBSYSTEM_ENV);
+    if(2*(env.count + 1) > env.capacity){
+        env_grow();
+    }
+    slot = env_slot(name, name_length);
+    if(!slot->pair){
+        env.count++;
+        slot->exported = 0;
+    }
+    else{
+        free(slot->pair);
+    }
+    slot->pair = malloc(name_length + value_length + 2);
+    if(!slot->pair){
+        raise_error("Failed allocation of `environment variable`.");
+    }
+    memcpy(slot->pair, name, name_length);
+    slot->pair[name_length] = '=';
+    memcpy(slot->pair + name_length + 1, value, value_length + 1);
+    slot->name_length = name_length;
+    slot->exported |= exported;
+    env.dirty |= slot->exported;
+
+    if(name_length == 4 && memcmp(name, "PATH", 4) == 0){
+        path_cache_clear();
+    }
+}
+
+void env_unset(const char* name){
+    size_t length = strlen(name);
+    size_t mask = env.capacity - 1;
+    size_t i, j, home;
+    struct EnvEntry* slot;
+
+    subsystem_need(SUBSYSTEM_ENV);
+    if(!env.capacity){
+        return;
+    }
+    slot = env_slot(name, length);
+    if(!slot->pair){
+        return;
+    }
+    env.dirty |= slot->exported;
+    free(slot->pair);
+    slot->pair = NULL;
+    env.count--;
+
+    // shift the rest of the probe run back so lookups never stop early
+    i = slot - env.entries;
+    for(j = (i + 1) & mask; env.entries[j].pair; j = (j + 1) & mask){
+        home = jshell_hash(env.entries[j].pair, env.entries[j].name_length) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            env.entries[i] = env.entries[j];
+            env.entries[j].pair = NULL;
+            i = j;
+        }
+    }
+
+    if(length == 4 && memcmp(name, "PATH", 4) == 0){
+        path_cache_clear();
+    }
+}
+
+// The environment children get. It's the same array until a variable in
+// it changes, so spawning copies nothing.
+char** env_envp(){
+    size_t i, n = 0;
+
+    subsystem_need(SUBSYSTEM_ENV);
+    if(!env.dirty){
+        return env.envp;
+    }
+    free(env.envp);
+    env.envp = malloc((env.count + 1)*sizeof(char*));
+    if(!env.envp){
+        raise_error("Failed allocation of `envp`.");
+    }
+    for(i=0; i<env.capacity; i++){
+        if(env.entries[i].pair && env.entries[i].exported){
+            env.envp[n++] = env.entries[i].pair;
+        }
+    }
+    env.envp[n] = NULL;
+    env.dirty = 0;
+    return env.envp;
+}
+
+// env_envp() with the stage's NAME=value words on top, for its command only
+char** env_stage_envp(struct Stage* stage){
+    char** base = env_envp();
+    char** envp;
+    size_t n = 0;
+    size_t length;
+    int i, k;
+
+    while(base[n]){
+        n++;
+    }
+    envp = arena_alloc(&jshell_arena, (n + stage->n_assigns + 1)*sizeof(char*));
+    n = 0;
+    for(i=0; base[i]; i++){
+        length = strchr(base[i], '=') - base[i] + 1;
+        for(k=0; k<stage->n_assigns && strncmp(base[i], stage->assigns[k], length) != 0; k++);
+        if(k == stage->n_assigns){
+            envp[n++] = base[i];
+        }
+    }
+    for(k=0; k<stage->n_assigns; k++){
+        envp[n++] = stage->assigns[k];
+    }
+    envp[n] = NULL;
+    return envp;
+}
+
+// NAME=value, with NAME a valid variable name
+int is_assignment(const char* word){
+    size_t i;
+
+    if(!(word[0] == '_' || (word[0] >= 'a' && word[0] <= 'z') || (word[0] >= 'A' && word[0] <= 'Z'))){
+        return 0;
+    }
+    for(i=1; word[i] && word[i] != '='; i++){
+        if(!(word[i] == '_' || (word[i] >= 'a' && word[i] <= 'z') ||
+             (word[i] >= 'A' && word[i] <= 'Z') || (word[i] >= '0' && word[i] <= '9'))){
+            return 0;
+        }
+    }
+    return word[i] == '=';
+}
+
+int jshell_argc = 0;      // positional parameters, $0 first
+char** jshell_argv = NULL;
+
+// Value of the $ reference at `ref` (just past the '$'), NULL when it's
+// unset. *consumed is how many bytes the reference takes, 0 if it isn't one.
+const char* expand_ref(const char* ref, size_t* consumed){
+    char name[JSHELL_GENERIC_LIMIT];
+    size_t length = 0;
+    size_t total;
+    char* value;
+    int i;
+
+    *consumed = 0;
+    if(ref[0] == '?' || ref[0] == '$' || ref[0] == '#'){
+        value = arena_alloc(&jshell_arena, 24);
+        snprintf(value, 24, "%d", ref[0] == '?' ? jshell_status : ref[0] == '$' ? (int)getpid() : jshell_argc > 0 ? jshell_argc - 1 : 0);
+        *consumed = 1;
+        return value;
+    }
+    if(ref[0] >= '0' && ref[0] <= '9'){
+        *consumed = 1;
+        return ref[0] - '0' < jshell_argc ? jshell_argv[ref[0] - '0'] : NULL;
+    }
+    if(ref[0] == '@' || ref[0] == '*'){
+        // one word, expansions are never split
+        *consumed = 1;
+        for(i=1, total=1; i<jshell_argc; i++){
+            total += strlen(jshell_argv[i]) + 1;
+        }
+        value = arena_alloc(&jshell_arena, total);
+        value[0] = '\0';
+        for(i=1; i<jshell_argc; i++){
+            strcat(value, jshell_argv[i]);
+            if(i + 1 < jshell_argc){
+                strcat(value, " ");
+            }
+        }
+        return value;
+    }
+
+    if(ref[0] == '{'){
+        while(ref[length+1] && ref[length+1] != '}'){
+            length++;
+        }
+        if(ref[length+1] != '}' || length == 0 || length >= sizeof(name)){
+            return NULL;
+        }
+        memcpy(name, ref + 1, length);
+        *consumed = length + 2;
+    }
+    else{
+        while(ref[length] == '_' || (ref[length] >= 'a' && ref[length] <= 'z') ||
+              (ref[length] >= 'A' && ref[length] <= 'Z') || (length > 0 && ref[length] >= '0' && ref[length] <= '9')){
+            length++;
+        }
+        if(length == 0 || length >= sizeof(name)){
+            return NULL;
+        }
+        memcpy(name, ref, length);
+        *consumed = length;
+    }
+    name[length] = '\0';
+    return env_get(name);
+}
+
+// END ENVIRONMENT
+
+// BUILTIN TABLE
+
+struct BuiltinTable builtin_table = { NULL, 0, 0 };
+
+size_t builtin_slot(const char* name){
+    return (jshell_hash(name, strlen(name)) * builtin_table.multiplier) >> builtin_table.shift;
+}
+
+// Searches for a multiplier that sends every builtin to its own slot. With
+// the table at least twice the number of builtins this takes a few tries.
+void builtin_table_init(){
+    int n_builtins = jshell_num_builtins();
+    int bits = 1;
+    size_t size, slot;
+    int i;
+
+    while((1 << bits) < 2*n_builtins){
+        bits++;
+    }
+    size = (size_t)1 << bits;
+    builtin_table.slots = calloc(size, sizeof(struct Builtin*));
+    if(!builtin_table.slots){
+        raise_error("Failed allocation of `builtin table`.");
+    }
+    builtin_table.shift = 64 - bits;
+    builtin_table.multiplier = 0x9E3779B97F4A7C15ULL;
+
+    for(;;){
+        for(i=0; i<n_builtins; i++){
+            slot = builtin_slot(builtins[i].name);
+            if(builtin_table.slots[slot]){
+                break;
+            }
+            builtin_table.slots[slot] = &builtins[i];
+        }
+        if(i == n_builtins){
+            return;
+        }
+
+        memset(builtin_table.slots, 0, size*sizeof(struct Builtin*));
+        builtin_table.multiplier = builtin_table.multiplier*6364136223846793005ULL + 1442695040888963407ULL;
+        builtin_table.multiplier |= 1;
+    }
+}
+
+struct Builtin* builtin_lookup(const char* name){
+    struct Builtin* builtin;
+
+    subsystem_need(SUBSYSTEM_BUILTINS);
+    builtin = builtin_table.slots[builtin_slot(name)];
+    if(builtin && strcmp(builtin->name, name) == 0){
+        return builtin;
+    }
+    return NULL;
+}
+
+// END BUILTIN TABLE
+
+// PLAN CACHE
+
+struct PlanCache plan_cache;
+
+void plan_cache_unlink(struct PlanEntry* entry){
+    struct PlanEntry** link = &plan_cache.buckets[entry->hash % JSHELL_PLAN_CACHE_BUCKETS];
+
+    while(*link != entry){
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+
+    if(entry->lru_prev){
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else{
+        plan_cache.lru_head = entry->lru_next;
+    }
+    if(entry->lru_next){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else{
+        plan_cache.lru_tail = entry->lru_prev;
+    }
+    plan_cache.count--;
+}
+
+void plan_cache_push(struct PlanEntry* entry){
+    struct PlanEntry** bucket = &plan_cache.buckets[entry->hash % JSHELL_PLAN_CACHE_BUCKETS];
+
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = plan_cache.lru_head;
+    if(plan_cache.lru_head){
+        plan_cache.lru_head->lru_prev = entry;
+    }
+    else{
+        plan_cache.lru_tail = entry;
+    }
+    plan_cache.lru_head = entry;
+    plan_cache.count++;
+}
+
+void plan_cache_clear(){
+    while(plan_cache.lru_head){
+        struct PlanEntry* entry = plan_cache.lru_head;
+        plan_cache_unlink(entry);
+        free(entry);
+    }
+}
+
+struct Plan* plan_cache_lookup(const char* line, size_t length, unsigned long long hash){
+    struct PlanEntry* entry = plan_cache.buckets[hash % JSHELL_PLAN_CACHE_BUCKETS];
+
+    for(; entry; entry = entry->bucket_next){
+        if(entry->hash == hash && entry->length == length && memcmp(entry->raw, line, length) == 0){
+            plan_cache.hits++;
+            if(entry != plan_cache.lru_head){
+                plan_cache_unlink(entry);
+                plan_cache_push(entry);
+            }
+            return &entry->plan;
+        }
+    }
+    plan_cache.misses++;
+    return NULL;
+}
+
+// Copies `plan` into the cache under `raw`. The stages point into `args`,
+// whose words point into the tokenized `line`, so both are copied and rebased.
+struct Plan* plan_cache_insert(const char* raw, size_t length, unsigned long long hash,
+                               struct Plan* plan, char** args, char* line){
+    struct PlanEntry* entry;
+    struct Stage* stages;
+    char** argv;
+    char* text;
+    int i, j;
+
+    if(plan_cache.count >= JSHELL_PLAN_CACHE_SIZE){
+        entry = plan_cache.lru_tail;
+        plan_cache_unlink(entry);
+        free(entry);
+    }
+
+    entry = malloc(sizeof(struct PlanEntry) + plan->n_stages*sizeof(struct Stage)
+                   + plan->n_args*sizeof(char*) + 2*(length + 1));
+    if(!entry){
+        raise_error("Failed allocation of `plan cache entry`.");
+    }
+    stages = (struct Stage*)(entry + 1);
+    argv = (char**)(stages + plan->n_stages);
+    entry->raw = (char*)(argv + plan->n_args);
+    text = entry->raw + length + 1;
+
+    memcpy(entry->raw, raw, length + 1);
+    memcpy(text, line, length + 1);
+    for(i=0; i<plan->n_args; i++){
+        argv[i] = args[i] ? text + (args[i] - line) : NULL;
+    }
+    for(i=0; i<plan->n_stages; i++){
+        stages[i] = plan->stages[i];
+        stages[i].argv = argv + (plan->stages[i].argv - args);
+        if(stages[i].assigns){
+            stages[i].assigns = argv + (plan->stages[i].assigns - args);
+        }
+        for(j=0; j<3; j++){
+            if(stages[i].redirects[j].path){
+                stages[i].redirects[j].path = text + (stages[i].redirects[j].path - line);
+            }
+        }
+    }
+
+    entry->hash = hash;
+    entry->length = length;
+    entry->plan = *plan;
+    entry->plan.stages = stages;
+    entry->plan.text = entry->raw;
+    if(plan->pin){
+        entry->plan.pin = text + (plan->pin - line);
+    }
+    if(plan->cgroup){
+        entry->plan.cgroup = text + (plan->cgroup - line);
+    }
+    plan_cache_push(entry);
+    return &entry->plan;
+}
+
+// END PLAN CACHE
+
+// HISTORY
+
+struct History history = { -1 };
+
+// Opens $JSHELL_HISTORY, ~/.jshell_history by default. Nothing is read.
+int history_open(){
+    const char* path = env_get("JSHELL_HISTORY");
+    const char* home = env_get("HOME");
+    char buffer[PATH_MAX];
+
+    if(history.fd >= 0){
+        return 0;
+    }
+    if(!path){
+        if(!home){
+            return -1;
+        }
+        snprintf(buffer, sizeof(buffer), "%s/%s", home, JSHELL_HISTORY_FILE);
+        path = buffer;
+    }
+    history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    return history.fd < 0 ? -1 : 0;
+}
+
+// Appends the line to the history file. One write per line with O_APPEND,
+// so sessions sharing the file never interleave their lines.
+void history_add(const char* line){
+    struct iovec iov[2];
+    size_t length = strlen(line);
+
+    while(length > 0 && is_delimiter(line[length-1])){
+        length--;
+    }
+    if(length == 0 || history_open() < 0){
+        return;
+    }
+
+    iov[0].iov_base = (void*)line;
+    iov[0].iov_len = length;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    if(writev(history.fd, iov, 2) < 0){
+        perror("jshell: history");
+    }
+}
+
+struct HistoryTrigram* history_trigram(unsigned int key){
+    size_t mask = history.trigram_capacity - 1;
+    size_t i = (key * 2654435761u) & mask;
+
+    while(history.trigrams[i].key && history.trigrams[i].key != key){
+        i = (i + 1) & mask;
+    }
+    return &history.trigrams[i];
+}
+
+void history_index_trigram(unsigned int key, unsigned int id){
+    struct HistoryTrigram* trigram;
+    size_t i;
+
+    if(2*(history.trigram_count + 1) > history.trigram_capacity){
+        struct HistoryTrigram* old = history.trigrams;
+        size_t old_capacity = history.trigram_capacity;
+
+        history.trigram_capacity = old_capacity ? 2*old_capacity : JSHELL_HISTORY_TRIGRAMS;
+        history.trigrams = calloc(history.trigram_capacity, sizeof(struct HistoryTrigram));
+        if(!history.trigrams){
+            raise_error("Failed allocation of `history trigrams`.");
+        }
+        for(i=0; i<old_capacity; i++){
+            if(old[i].key){
+                *history_trigram(old[i].key) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    trigram = history_trigram(key);
+    if(!trigram->key){
+        trigram->key = key;
+        history.trigram_count++;
+    }
+    // entries are indexed in order, a repeat within one is always the last id
+    if(trigram->count && trigram->ids[trigram->count-1] == id){
+        return;
+    }
+    if(trigram->count >= trigram->capacity){
+        trigram->capacity = trigram->capacity ? 2*trigram->capacity : 4;
+        trigram->ids = realloc(trigram->ids, trigram->capacity*sizeof(unsigned int));
+        if(!trigram->ids){
+            raise_error("Failed allocation of `history postings`.");
+        }
+    }
+    trigram->ids[trigram->count++] = id;
+}
+
+unsigned int history_key(const char* c){
+    return ((unsigned char)c[0] << 16 | (unsigned char)c[1] << 8 | (unsigned char)c[2]) + 1;
+}
+
+void history_reset(){
+    size_t i;
+
+    for(i=0; i<history.trigram_capacity; i++){
+        free(history.trigrams[i].ids);
+    }
+    free(history.trigrams);
+    free(history.offsets);
+    if(history.map){
+        munmap(history.map, history.mapped);
+    }
+    history.trigrams = NULL;
+    history.trigram_capacity = history.trigram_count = 0;
+    history.trigram_indexed = 0;
+    history.offsets = NULL;
+    history.count = history.capacity = 0;
+    history.map = NULL;
+    history.mapped = history.indexed = 0;
+}
+
+// Maps whatever the file has grown to and records where its new complete
+// lines start
+int history_sync(){
+    struct stat st;
+    const char* line;
+    const char* end;
+    size_t length;
+
+    if(history_open() < 0 || fstat(history.fd, &st) < 0){
+        return -1;
+    }
+    if((size_t)st.st_size < history.indexed){
+        // truncated behind our back
+        history_reset();
+    }
+    if((size_t)st.st_size == history.mapped){
+        return 0;
+    }
+
+    if(history.map){
+        munmap(history.map, history.mapped);
+    }
+    history.mapped = st.st_size;
+    history.map = mmap(NULL, history.mapped, PROT_READ, MAP_SHARED, history.fd, 0);
+    if(history.map == MAP_FAILED){
+        history.map = NULL;
+        history.mapped = 0;
+        history_reset();
+        return -1;
+    }
+
+    while(history.indexed < history.mapped){
+        line = history.map + history.indexed;
+        end = memchr(line, '\n', history.mapped - history.indexed);
+        if(!end){
+            // still being written
+            break;
+        }
+        length = end - line;
+
+        if(history.count >= history.capacity){
+            history.capacity = history.capacity ? 2*history.capacity : JSHELL_HISTORY_TRIGRAMS;
+            history.offsets = realloc(history.offsets, history.capacity*sizeof(size_t));
+            if(!history.offsets){
+                raise_error("Failed allocation of `history offsets`.");
+            }
+        }
+        history.offsets[history.count++] = history.indexed;
+        history.indexed += length + 1;
+    }
+    return 0;
+}
+
+// Entry `id`, not NUL terminated. Valid until the next history_sync().
+const char* history_entry(unsigned int id, size_t* length){
+    size_t end = id + 1 < history.count ? history.offsets[id+1] : history.indexed;
+
+    *length = end - history.offsets[id] - 1;
+    return history.map + history.offsets[id];
+}
+
+// Adds the entries synced since the last search to the trigram index
+void history_index(){
+    const char* entry;
+    size_t length;
+    size_t i;
+
+    for(; history.trigram_indexed < history.count; history.trigram_indexed++){
+        entry = history_entry(history.trigram_indexed, &length);
+        for(i=0; i+3<=length; i++){
+            history_index_trigram(history_key(entry + i), history.trigram_indexed);
+        }
+    }
+}
+
+// Newest entry older than `before` (all of them when negative) containing
+// `query`, -1 if none. Only entries holding the query's rarest trigram are
+// looked at, queries shorter than a trigram scan every entry.
+int history_search(const char* query, int before){
+    struct HistoryTrigram* rarest = NULL;
+    struct HistoryTrigram* trigram;
+    size_t query_length = strlen(query);
+    size_t length;
+    const char* entry;
+    unsigned int lo, hi, mid;
+    size_t i;
+    int id;
+
+    if(before < 0 || (unsigned int)before > history.count){
+        before = history.count;
+    }
+
+    if(query_length < 3){
+        for(id=before-1; id>=0; id--){
+            entry = history_entry(id, &length);
+            if(memmem(entry, length, query, query_length)){
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    history_index();
+    if(!history.trigram_capacity){
+        return -1;
+    }
+    for(i=0; i+3<=query_length; i++){
+        trigram = history_trigram(history_key(query + i));
+        if(!trigram->key){
+            return -1;
+        }
+        if(!rarest || trigram->count < rarest->count){
+            rarest = trigram;
+        }
+    }
+
+    // first posting not older than `before`
+    lo = 0;
+    hi = rarest->count;
+    while(lo < hi){
+        mid = (lo + hi)/2;
+        if(rarest->ids[mid] < (unsigned int)before){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    while(lo-- > 0){
+        entry = history_entry(rarest->ids[lo], &length);
+        if(memmem(entry, length, query, query_length)){
+            return rarest->ids[lo];
+        }
+    }
+    return -1;
+}
+
+// END HISTORY
+
+// COMPLETION
+
+struct Completion completion = { NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, { -1, -1 } };
+
+struct Trie* trie_create(){
+    struct Trie* trie = malloc(sizeof(struct Trie));
+
+    if(!trie){
+        raise_error("Failed allocation of `trie`.");
+    }
+    trie->capacity = JSHELL_GENERIC_LIMIT;
+    trie->nodes = malloc(trie->capacity*sizeof(struct TrieNode));
+    if(!trie->nodes){
+        raise_error("Failed allocation of `trie nodes`.");
+    }
+    trie->nodes[0].child = trie->nodes[0].sibling = -1;
+    trie->nodes[0].c = '\0';
+    trie->nodes[0].terminal = 0;
+    trie->count = 1;
+    return trie;
+}
+
+void trie_free(struct Trie* trie){
+    if(trie){
+        free(trie->nodes);
+        free(trie);
+    }
+}
+
+// Child of `node` for c, created when `add` is set, -1 if there's none
+int trie_child(struct Trie* trie, int node, char c, int add){
+    int i;
+
+    for(i=trie->nodes[node].child; i>=0; i=trie->nodes[i].sibling){
+        if(trie->nodes[i].c == c){
+            return i;
+        }
+    }
+    if(!add){
+        return -1;
+    }
+
+    if(trie->count >= trie->capacity){
+        trie->capacity *= 2;
+        trie->nodes = realloc(trie->nodes, trie->capacity*sizeof(struct TrieNode));
+        if(!trie->nodes){
+            raise_error("Failed allocation of `trie nodes`.");
+        }
+    }
+    i = trie->count++;
+    trie->nodes[i].c = c;
+    trie->nodes[i].terminal = 0;
+    trie->nodes[i].child = -1;
+    trie->nodes[i].sibling = trie->nodes[node].child;
+    trie->nodes[node].child = i;
+    return i;
+}
+
+void trie_insert(struct Trie* trie, const char* name){
+    int node = 0;
+
+    for(; *name; name++){
+        node = trie_child(trie, node, *name, 1);
+    }
+    trie->nodes[node].terminal = 1;
+}
+
+// Node reached by `prefix`, -1 if no name starts with it
+int trie_find(struct Trie* trie, const char* prefix, size_t length){
+    int node = 0;
+    size_t i;
+
+    for(i=0; i<length && node>=0; i++){
+        node = trie_child(trie, node, prefix[i], 0);
+    }
+    return node;
+}
+
+// Appends to `names` every name below `node`, which spells `prefix`
+void trie_collect(struct Trie* trie, int node, char* prefix, size_t length,
+                  char** names, int* count, int limit){
+    int i;
+
+    if(*count >= limit || length + 1 >= PATH_MAX){
+        return;
+    }
+    if(trie->nodes[node].terminal){
+        prefix[length] = '\0';
+        names[(*count)++] = strdup(prefix);
+    }
+    for(i=trie->nodes[node].child; i>=0; i=trie->nodes[i].sibling){
+        prefix[length] = trie->nodes[i].c;
+        trie_collect(trie, i, prefix, length + 1, names, count, limit);
+    }
+}
+
+// Every executable of every PATH directory, plus the builtins. Runs on the
+// completion thread, so it only touches its own memory.
+struct Trie* trie_build(const char* path_env, struct timespec* mtimes, int n_dirs){
+    struct Trie* trie = trie_create();
+    struct dirent* entry;
+    struct stat st;
+    char* dirs = strdup(path_env ? path_env : "");
+    char* dir;
+    char* rest = dirs;
+    DIR* d;
+    int i = 0;
+
+    for(; i<jshell_num_builtins(); i++){
+        trie_insert(trie, builtins[i].name);
+    }
+
+    for(i=0; (dir = strsep(&rest, ":")) != NULL; i++){
+        d = opendir(*dir ? dir : ".");
+        if(i < n_dirs){
+            mtimes[i].tv_sec = mtimes[i].tv_nsec = 0;
+        }
+        if(!d){
+            continue;
+        }
+        if(i < n_dirs && fstat(dirfd(d), &st) == 0){
+            mtimes[i] = st.st_mtim;
+        }
+        while((entry = readdir(d)) != NULL){
+            if(entry->d_name[0] == '.' || entry->d_type == DT_DIR){
+                continue;
+            }
+            if(entry->d_type != DT_REG
+               && (fstatat(dirfd(d), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))){
+                continue;
+            }
+            if(faccessat(dirfd(d), entry->d_name, X_OK, 0) == 0){
+                trie_insert(trie, entry->d_name);
+            }
+        }
+        closedir(d);
+    }
+    free(dirs);
+    return trie;
+}
+
+// Some PATH directory changed since `mtimes` were taken
+int completion_stale(const char* path_env, struct timespec* mtimes, int n_dirs){
+    char* dirs = strdup(path_env ? path_env : "");
+    char* rest = dirs;
+    char* dir;
+    struct stat st;
+    int stale = 0;
+    int i;
+
+    for(i=0; !stale && i<n_dirs && (dir = strsep(&rest, ":")) != NULL; i++){
+        if(stat(*dir ? dir : ".", &st) != 0){
+            st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        }
+        stale = st.st_mtim.tv_sec != mtimes[i].tv_sec || st.st_mtim.tv_nsec != mtimes[i].tv_nsec;
+    }
+    free(dirs);
+    return stale;
+}
+
+// Builds the trie, then waits for inotify events on the PATH directories,
+// a PATH change from the main thread, or the periodic mtime check, and
+// builds it again
+void* completion_thread(void* arg){
+    struct pollfd fds[2];
+    struct timespec* mtimes;
+    struct Trie* trie;
+    char events[4096];
+    long long span;
+    char* path_env;
+    char* rest;
+    char* dir;
+    int n_dirs;
+    int notify;
+    int ready;
+    int i;
+
+    for(;;){
+        pthread_mutex_lock(&completion.lock);
+        path_env = strdup(completion.path_env ? completion.path_env : "");
+        pthread_mutex_unlock(&completion.lock);
+
+        // watches go in before the scan, so nothing added during it is missed
+        notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        n_dirs = 1;
+        for(i=0; path_env[i]; i++){
+            n_dirs += path_env[i] == ':';
+        }
+        rest = path_env;
+        while(notify >= 0 && (dir = strsep(&rest, ":")) != NULL){
+            inotify_add_watch(notify, *dir ? dir : ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+        }
+        free(path_env);
+
+        pthread_mutex_lock(&completion.lock);
+        path_env = strdup(completion.path_env ? completion.path_env : "");
+        pthread_mutex_unlock(&completion.lock);
+        mtimes = calloc(n_dirs, sizeof(struct timespec));
+        span = trace_begin();
+        trie = trie_build(path_env, mtimes, n_dirs);
+        trace_end(span, "path_index", NULL);
+        trie = __atomic_exchange_n(&completion.pending, trie, __ATOMIC_ACQ_REL);
+        trie_free(trie);
+
+        fds[0].fd = completion.wake_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = notify;
+        fds[1].events = POLLIN;
+        for(;;){
+            ready = poll(fds, 2, JSHELL_COMPLETION_POLL_MS);
+            if(ready < 0 && errno == EINTR){
+                continue;
+            }
+            if(ready > 0 && (fds[0].revents & POLLIN)){
+                while(read(completion.wake_pipe[0], events, sizeof(events)) > 0);
+                break;
+            }
+            if(ready > 0 && (fds[1].revents & POLLIN)){
+                // let a burst of changes (an install) settle, then rebuild once
+                do{
+                    while(read(notify, events, sizeof(events)) > 0);
+                }while(poll(&fds[1], 1, 100) > 0);
+                break;
+            }
+            if(ready == 0 && completion_stale(path_env, mtimes, n_dirs)){
+                break;
+            }
+        }
+        if(notify >= 0){
+            close(notify);
+        }
+        free(mtimes);
+        free(path_env);
+    }
+    return NULL;
+}
+
+// Starts the completion thread for the current PATH
+void completion_start(){
+    sigset_t all, old;
+
+    completion.path_env = strdup(env_get("PATH") ? env_get("PATH") : "");
+    if(pipe2(completion.wake_pipe, O_NONBLOCK | O_CLOEXEC) < 0){
+        return;
+    }
+
+    // signals stay with the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    completion.started = pthread_create(&completion.thread, NULL, completion_thread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(completion.started){
+        pthread_detach(completion.thread);
+    }
+}
+
+// The newest trie. Until the thread's first one is ready, names come from
+// the PATH cache and the builtins.
+struct Trie* completion_trie(){
+    struct Trie* trie;
+    const char* path_env = env_get("PATH") ? env_get("PATH") : "";
+    size_t i;
+
+    if(completion.started && strcmp(path_env, completion.path_env) != 0){
+        pthread_mutex_lock(&completion.lock);
+        free(completion.path_env);
+        completion.path_env = strdup(path_env);
+        pthread_mutex_unlock(&completion.lock);
+        if(write(completion.wake_pipe[1], "", 1) < 0){
+            // a wakeup is already pending
+        }
+    }
+
+    trie = __atomic_exchange_n(&completion.pending, NULL, __ATOMIC_ACQ_REL);
+    if(trie){
+        trie_free(completion.current);
+        completion.current = trie;
+    }
+    if(completion.current){
+        return completion.current;
+    }
+
+    trie = trie_create();
+    for(i=0; i<(size_t)jshell_num_builtins(); i++){
+        trie_insert(trie, builtins[i].name);
+    }
+    for(i=0; i<path_cache.capacity; i++){
+        if(path_cache.entries[i].name && !strchr(path_cache.entries[i].name, '/')){
+            trie_insert(trie, path_cache.entries[i].name);
+        }
+    }
+    return trie;
+}
+
+int completion_compare(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// END COMPLETION
+
+// LINE EDITOR
+
+struct Editor editor;
+
+void editor_reserve(char** buffer, size_t* capacity, size_t size){
+    if(size <= *capacity){
+        return;
+    }
+    *capacity = *capacity ? *capacity : JSHELL_LINE_BUFFER_SIZE;
+    while(*capacity < size){
+        *capacity *= 2;
+    }
+    *buffer = realloc(*buffer, *capacity);
+    if(!*buffer){
+        raise_error("Failed allocation of `editor buffer`.");
+    }
+}
+
+void editor_output(const char* data, size_t length){
+    editor_reserve(&editor.out, &editor.out_capacity, editor.out_length + length);
+    memcpy(editor.out + editor.out_length, data, length);
+    editor.out_length += length;
+}
+
+// Moves the cursor between two offsets into the line, which may be on
+// different rows once the line wraps
+void editor_move(size_t from, size_t to){
+    char sequence[64];
+    size_t from_row = (editor.origin + from)/editor.columns;
+    size_t to_row = (editor.origin + to)/editor.columns;
+    size_t from_column = (editor.origin + from)%editor.columns;
+    size_t to_column = (editor.origin + to)%editor.columns;
+    int n = 0;
+
+    if(from_row != to_row){
+        n += snprintf(sequence + n, sizeof(sequence) - n, "\x1b[%zu%c",
+                      from_row > to_row ? from_row - to_row : to_row - from_row, from_row > to_row ? 'A' : 'B');
+    }
+    if(from_column != to_column){
+        n += snprintf(sequence + n, sizeof(sequence) - n, "\x1b[%zu%c",
+                      from_column > to_column ? from_column - to_column : to_column - from_column,
+                      from_column > to_column ? 'D' : 'C');
+    }
+    editor_output(sequence, n);
+}
+
+// After output that ended in the last column the terminal keeps the
+// cursor there until the next character, it's moved to the next row so
+// that it is where editor_move() thinks
+void editor_wrap(size_t end){
+    if((editor.origin + end)%editor.columns == 0 && editor.origin + end > 0){
+        editor_output("\r\n", 2);
+    }
+}
+
+// Reprints the prompt, without its blank line, for a line that starts over
+void editor_prompt(){
+    editor_output(prompt_buffer + 1, prompt_length - 1);
+    editor_wrap(0);
+    editor.shown_length = editor.shown_cursor = 0;
+}
+
+// Leaves the cursor below the line, for output that follows it
+void editor_newline(){
+    editor_move(editor.shown_cursor, editor.shown_length);
+    if(editor.shown_length == 0 || (editor.origin + editor.shown_length)%editor.columns != 0){
+        editor_output("\n", 1);
+    }
+}
+
+void editor_flush(){
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < editor.out_length){
+        n = write(STDOUT_FILENO, editor.out + done, editor.out_length - done);
+        if(n < 0 && errno != EINTR){
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+    editor.out_length = 0;
+}
+
+// Brings the terminal from `shown` to the current line (or the search
+// status), writing from the first column that differs only
+void editor_refresh(){
+    char* want = editor.line;
+    size_t want_length = editor.length;
+    size_t want_cursor = editor.cursor;
+    size_t same = 0;
+    const char* entry;
+    size_t entry_length;
+
+    if(editor.searching){
+        size_t query_length = strlen(editor.query);
+        const char* found = NULL;
+
+        entry_length = 0;
+        entry = "";
+        if(editor.match >= 0){
+            entry = history_entry(editor.match, &entry_length);
+            found = memmem(entry, entry_length, editor.query, query_length);
+        }
+        want_length = strlen(JSHELL_SEARCH_LABEL) + query_length + 3 + entry_length;
+        want = arena_alloc(&jshell_arena, want_length + 1);
+        snprintf(want, want_length + 1, "%s%s': %.*s", JSHELL_SEARCH_LABEL, editor.query, (int)entry_length, entry);
+        want_cursor = want_length - entry_length + (found ? found - entry : 0);
+    }
+
+    while(same < want_length && same < editor.shown_length && want[same] == editor.shown[same]){
+        same++;
+    }
+    if(same == want_length && same == editor.shown_length){
+        // only the cursor moved
+        editor_move(editor.shown_cursor, want_cursor);
+    }
+    else{
+        editor_move(editor.shown_cursor, same);
+        editor_output(want + same, want_length - same);
+        if(want_length > same){
+            editor_wrap(want_length);
+        }
+        if(editor.shown_length > want_length){
+            // the rows the line took up below, too
+            editor_output("\x1b[J", 3);
+        }
+        editor_move(want_length, want_cursor);
+    }
+    editor_flush();
+
+    editor_reserve(&editor.shown, &editor.shown_capacity, want_length + 1);
+    memcpy(editor.shown, want, want_length);
+    editor.shown_length = want_length;
+    editor.shown_cursor = want_cursor;
+}
+
+void editor_set(const char* text, size_t length){
+    editor_reserve(&editor.line, &editor.capacity, length + 1);
+    memcpy(editor.line, text, length);
+    editor.length = editor.cursor = length;
+}
+
+void editor_insert(char c){
+    editor_reserve(&editor.line, &editor.capacity, editor.length + 2);
+    memmove(editor.line + editor.cursor + 1, editor.line + editor.cursor, editor.length - editor.cursor);
+    editor.line[editor.cursor++] = c;
+    editor.length++;
+}
+
+void editor_delete(size_t from, size_t to){
+    memmove(editor.line + from, editor.line + to, editor.length - to);
+    editor.length -= to - from;
+    editor.cursor = from;
+}
+
+// Up/down: steps through the history file, the new line is kept aside
+void editor_history(int step){
+    const char* entry;
+    size_t length;
+    int id = editor.history_id + step;
+
+    if(id < 0 || (unsigned int)id > history.count){
+        return;
+    }
+    if((unsigned int)editor.history_id == history.count){
+        free(editor.saved);
+        editor.saved = strndup(editor.line, editor.length);
+    }
+    editor.history_id = id;
+    if((unsigned int)id == history.count){
+        editor_set(editor.saved ? editor.saved : "", editor.saved ? strlen(editor.saved) : 0);
+        return;
+    }
+    entry = history_entry(id, &length);
+    editor_set(entry, length);
+}
+
+// Ctrl-R mode, returns 1 once the key ended the search
+int editor_search_key(int key){
+    size_t query_length = strlen(editor.query);
+    const char* entry;
+    size_t length;
+    int found;
+
+    if(key == CTRL('r')){
+        if(editor.match >= 0){
+            found = history_search(editor.query, editor.match);
+            editor.match = found >= 0 ? found : editor.match;
+        }
+        return 0;
+    }
+    if(key == 127 || key == CTRL('h')){
+        if(query_length > 0){
+            editor.query[query_length-1] = '\0';
+            editor.match = history_search(editor.query, -1);
+        }
+        return 0;
+    }
+    if(key == CTRL('g') || key == CTRL('c')){
+        editor.searching = 0;
+        return 1;
+    }
+    if(key >= ' ' && key < 127 && query_length + 1 < sizeof(editor.query)){
+        editor.query[query_length] = key;
+        editor.query[query_length+1] = '\0';
+        // the current match is still the newest if it contains the longer query
+        editor.match = history_search(editor.query, editor.match >= 0 ? editor.match + 1 : -1);
+        return 0;
+    }
+
+    // anything else takes the match and is handled as usual
+    if(editor.match >= 0){
+        entry = history_entry(editor.match, &length);
+        editor_set(entry, length);
+        editor.history_id = editor.match;
+    }
+    editor.searching = 0;
+    return 1;
+}
+
+// Tab on a command word: extends it as far as the trie is unambiguous, a
+// second Tab lists the candidates. Arguments aren't completed.
+void editor_complete(int list){
+    struct Trie* trie;
+    char** names;
+    char prefix[PATH_MAX];
+    size_t start = editor.cursor;
+    size_t before, length, i;
+    int count = 0;
+    int node, child;
+
+    while(start > 0 && !is_delimiter(editor.line[start-1]) && !is_operator(editor.line[start-1])){
+        start--;
+    }
+    before = start;
+    while(before > 0 && is_delimiter(editor.line[before-1])){
+        before--;
+    }
+    length = editor.cursor - start;
+    if((before > 0 && editor.line[before-1] != '|' && editor.line[before-1] != '&')
+       || memchr(editor.line + start, '/', length) || length + 1 >= sizeof(prefix)){
+        editor_output("\a", 1);
+        return;
+    }
+
+    trie = completion_trie();
+    node = trie_find(trie, editor.line + start, length);
+    if(node < 0){
+        editor_output("\a", 1);
+    }
+    else if(!list){
+        // the common prefix of every candidate
+        for(i=0; !trie->nodes[node].terminal && (child = trie->nodes[node].child) >= 0
+                 && trie->nodes[child].sibling < 0; i++){
+            editor_insert(trie->nodes[child].c);
+            node = child;
+        }
+        if(trie->nodes[node].terminal && trie->nodes[node].child < 0){
+            editor_insert(' ');
+        }
+        else if(i == 0){
+            editor_output("\a", 1);
+        }
+    }
+    else{
+        names = malloc(JSHELL_COMPLETION_LIST_LIMIT*sizeof(char*));
+        if(!names){
+            raise_error("Failed allocation of `completion names`.");
+        }
+        memcpy(prefix, editor.line + start, length);
+        trie_collect(trie, node, prefix, length, names, &count, JSHELL_COMPLETION_LIST_LIMIT);
+        qsort(names, count, sizeof(char*), completion_compare);
+
+        editor_newline();
+        for(i=0; i<(size_t)count; i++){
+            editor_output(names[i], strlen(names[i]));
+            editor_output(i + 1 < (size_t)count ? "  " : "\n", i + 1 < (size_t)count ? 2 : 1);
+            free(names[i]);
+        }
+        free(names);
+        // the line starts over below the list
+        editor_prompt();
+    }
+
+    if(trie != completion.current){
+        trie_free(trie);
+    }
+}
+
+// Applies one key, returns 1 when the line is complete, -1 at end of input
+int editor_key(int key){
+    int last_key = editor.last_key;
+
+    editor.last_key = key;
+    if(key == '\t' && !editor.searching){
+        editor_complete(last_key == '\t');
+        return 0;
+    }
+    return editor_apply(key);
+}
+
+int editor_apply(int key){
+    size_t i;
+
+    if(editor.searching && !editor_search_key(key)){
+        return 0;
+    }
+    if(editor.searching == 0 && key == CTRL('g')){
+        return 0;
+    }
+
+    switch(key){
+        case '\r':
+        case '\n':
+            return 1;
+        case CTRL('d'):
+            if(editor.length == 0){
+                return -1;
+            }
+            // fall through
+        case KEY_DELETE:
+            if(editor.cursor < editor.length){
+                editor_delete(editor.cursor, editor.cursor + 1);
+            }
+            break;
+        case 127:
+        case CTRL('h'):
+            if(editor.cursor > 0){
+                editor_delete(editor.cursor - 1, editor.cursor);
+            }
+            break;
+        case CTRL('b'):
+        case KEY_LEFT:
+            editor.cursor -= editor.cursor > 0;
+            break;
+        case CTRL('f'):
+        case KEY_RIGHT:
+            editor.cursor += editor.cursor < editor.length;
+            break;
+        case CTRL('a'):
+        case KEY_HOME:
+            editor.cursor = 0;
+            break;
+        case CTRL('e'):
+        case KEY_END:
+            editor.cursor = editor.length;
+            break;
+        case CTRL('k'):
+            editor.length = editor.cursor;
+            break;
+        case CTRL('u'):
+            editor_delete(0, editor.cursor);
+            break;
+        case CTRL('w'):
+            i = editor.cursor;
+            while(i > 0 && is_delimiter(editor.line[i-1])){
+                i--;
+            }
+            while(i > 0 && !is_delimiter(editor.line[i-1])){
+                i--;
+            }
+            editor_delete(i, editor.cursor);
+            break;
+        case CTRL('p'):
+        case KEY_UP:
+            editor_history(-1);
+            break;
+        case CTRL('n'):
+        case KEY_DOWN:
+            editor_history(1);
+            break;
+        case CTRL('r'):
+            editor.searching = 1;
+            editor.query[0] = '\0';
+            editor.match = history_search("", -1);
+            break;
+        case CTRL('l'):
+            // reprint from scratch at the top
+            editor_output("\x1b[H\x1b[2J", 7);
+            editor_prompt();
+            break;
+        case CTRL('c'):
+            editor_output("^C", 2);
+            editor.shown_length = editor.shown_cursor = 0;
+            editor.length = editor.cursor = 0;
+            return 1;
+        default:
+            if(key >= ' ' && key < 256 && key != 127){
+                editor_insert(key);
+            }
+            break;
+    }
+    return 0;
+}
+
+// Maps the bytes of an escape sequence to a key, 0 while it's incomplete,
+// -1 for sequences the editor ignores
+int editor_escape(){
+    char* e = editor.escape;
+    char final;
+
+    if(editor.escape_length < 2){
+        return 0;
+    }
+    if(e[1] != '[' && e[1] != 'O'){
+        return -1;
+    }
+    if(editor.escape_length < 3){
+        return 0;
+    }
+    final = e[editor.escape_length-1];
+    if(final >= '0' && final <= '9'){
+        return editor.escape_length < (int)sizeof(editor.escape) ? 0 : -1;
+    }
+    switch(final){
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch(e[2]){
+                case '1': case '7': return KEY_HOME;
+                case '4': case '8': return KEY_END;
+                case '3': return KEY_DELETE;
+            }
+    }
+    return -1;
+}
+
+// Background jobs ended while a line is being edited: the report goes
+// below it and the line is drawn again under a fresh prompt
+void editor_notify(){
+    editor_newline();
+    editor_flush();
+    jobs_notify();
+    show_prompt();
+    editor_wrap(0);
+    editor.shown_length = editor.shown_cursor = 0;
+    editor_refresh();
+}
+
+// Reads a line from the terminal in raw mode. Everything one read returns
+// (a keypress, or a whole paste) is applied before the single refresh,
+// up to the end of the line. The rest waits in editor.input for the next call.
+char* editor_read_line(){
+    struct termios cooked, raw;
+    struct winsize size;
+    unsigned char c;
+    int done = 0;
+    int key;
+    ssize_t n;
+    int i;
+
+    if(tcgetattr(STDIN_FILENO, &cooked) < 0){
+        return jshell_read_line();
+    }
+    raw = cooked;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    editor.columns = JSHELL_TERMINAL_COLUMNS;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0){
+        editor.columns = size.ws_col;
+    }
+    // the prompt is printed already, its width tells where the line starts
+    editor.origin = 0;
+    for(i=1; i<prompt_length; i++){
+        editor.origin += ((unsigned char)prompt_buffer[i] & 0xc0) != 0x80;
+    }
+    editor.origin %= editor.columns;
+
+    history_sync();
+    editor.length = editor.cursor = 0;
+    editor.shown_length = editor.shown_cursor = 0;
+    editor.escape_length = 0;
+    editor.history_id = history.count;
+    editor.searching = 0;
+    editor.last_key = 0;
+    editor_reserve(&editor.line, &editor.capacity, 1);
+
+    editor_wrap(0);
+    while(!done){
+        if(editor.input_start == editor.input_end){
+            editor_flush();
+            input_wait(STDIN_FILENO, editor_notify);
+            n = read(STDIN_FILENO, editor.input, sizeof(editor.input));
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                done = -1;
+                break;
+            }
+            editor.input_start = 0;
+            editor.input_end = n;
+        }
+
+        while(editor.input_start < editor.input_end && !done){
+            c = editor.input[editor.input_start++];
+            if(editor.escape_length || c == 0x1b){
+                editor.escape[editor.escape_length++] = c;
+                key = editor_escape();
+                if(key == 0){
+                    continue;
+                }
+                editor.escape_length = 0;
+                if(key < 0){
+                    continue;
+                }
+            }
+            else{
+                key = c;
+            }
+            done = editor_key(key);
+        }
+        if(done >= 0){
+            editor_refresh();
+        }
+    }
+
+    if(done > 0){
+        editor_newline();
+        editor_flush();
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+
+    if(done < 0){
+        return NULL;
+    }
+    editor.line[editor.length] = '\0';
+    return editor.line;
+}
+
+// END LINE EDITOR
+
+// JOBS
+
+struct JobTable job_table = { NULL, 0, 0, { -1, -1 } };
+volatile sig_atomic_t jobs_pending = 0;
+pid_t shell_pgid;
+struct termios shell_tmodes;
+
+void jobs_sigchld(int sig){
+    int saved_errno = errno;
+    char c = 0;
+
+    jobs_pending = 1;
+    if(write(job_table.sigchld_pipe[1], &c, 1) < 0){
+        // pipe already full, a wakeup is pending anyway
+    }
+    errno = saved_errno;
+}
+
+void jobs_init(){
+    struct sigaction sa;
+
+    if(pipe2(job_table.sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0){
+        raise_error("Failed creation of the SIGCHLD pipe.");
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = jobs_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if(jshell_interactive){
+        // take the terminal, children get their own process groups
+        while(tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())){
+            kill(-shell_pgid, SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        shell_pgid = getpid();
+        if(setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM){
+            perror("jshell: setpgid");
+        }
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+    }
+}
+
+struct Job* job_create(const char* command, int n_procs){
+    struct Job* job;
+    int i;
+
+    // SIGCHLD is handled from the first child on
+    subsystem_need(SUBSYSTEM_JOBS);
+    for(i=0; i<job_table.capacity && job_table.jobs[i]; i++);
+    if(i == job_table.capacity){
+        job_table.capacity = job_table.capacity ? 2*job_table.capacity : JSHELL_JOB_BUFFER_SIZE;
+        job_table.jobs = realloc(job_table.jobs, job_table.capacity*sizeof(struct Job*));
+        if(!job_table.jobs){
+            raise_error("Failed allocation of `job table`.");
+        }
+        memset(job_table.jobs + i, 0, (job_table.capacity - i)*sizeof(struct Job*));
+    }
+
+    job = calloc(1, sizeof(struct Job));
+    if(job){
+        job->procs = malloc(n_procs*sizeof(struct JobProcess));
+        job->command = strdup(command ? command : "");
+    }
+    if(!job || !job->procs || !job->command){
+        raise_error("Failed allocation of `job`.");
+    }
+    job->id = i + 1;
+    job->failed_status = JSHELL_NOT_FOUND;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job_table.jobs[i] = job;
+    return job;
+}
+
+void job_free(struct Job* job){
+    int i;
+
+    for(i=0; i<job->n_procs; i++){
+        free(job->procs[i].name);
+    }
+    job_table.jobs[job->id - 1] = NULL;
+    if(job_table.current == job->id){
+        job_table.current = 0;
+    }
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+struct Job* job_find(int id){
+    if(id < 1 || id > job_table.capacity){
+        return NULL;
+    }
+    return job_table.jobs[id - 1];
+}
+
+// The job one of whose processes is `pid`, pids are compared one by one
+// since they are neither ordered within a job nor unique over time
+struct Job* job_find_pid(pid_t pid){
+    int i, j;
+
+    for(i=0; i<job_table.capacity; i++){
+        if(!job_table.jobs[i]){
+            continue;
+        }
+        for(j=0; j<job_table.jobs[i]->n_procs; j++){
+            if(job_table.jobs[i]->procs[j].pid == pid){
+                return job_table.jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+int job_state(struct Job* job){
+    int i, stopped = 0;
+
+    for(i=0; i<job->n_procs; i++){
+        if(job->procs[i].state == JOB_RUNNING){
+            return JOB_RUNNING;
+        }
+        stopped |= job->procs[i].state == JOB_STOPPED;
+    }
+    return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+// Status of the pipeline, the one of its last command
+int job_status(struct Job* job){
+    if(!job->last_spawned || !job->n_procs){
+        return job->failed_status;
+    }
+    return job->procs[job->n_procs - 1].status;
+}
+
+void job_update(pid_t pid, int status, struct rusage* usage){
+    struct JobProcess* proc;
+    int i, j;
+
+    for(i=0; i<job_table.capacity; i++){
+        if(!job_table.jobs[i]){
+            continue;
+        }
+        for(j=0; j<job_table.jobs[i]->n_procs; j++){
+            proc = &job_table.jobs[i]->procs[j];
+            if(proc->pid != pid){
+                continue;
+            }
+
+            if(WIFSTOPPED(status)){
+                proc->state = JOB_STOPPED;
+                proc->status = 128 + WSTOPSIG(status);
+            }
+            else if(WIFCONTINUED(status)){
+                proc->state = JOB_RUNNING;
+            }
+            else{
+                proc->state = JOB_DONE;
+                proc->status = jshell_wait_status(status);
+                proc->usage = *usage;
+                clock_gettime(CLOCK_MONOTONIC, &proc->end);
+            }
+            return;
+        }
+    }
+}
+
+// Collects every child that changed state. Without `block` this is free
+// unless SIGCHLD arrived since the last call.
+void jobs_reap(int block){
+    char drain[64];
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    if(!block && !jobs_pending){
+        return;
+    }
+    jobs_pending = 0;
+    while(read(job_table.sigchld_pipe[0], drain, sizeof(drain)) > 0);
+
+    for(;;){
+        pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if(pid <= 0){
+            break;
+        }
+        job_update(pid, status, &usage);
+    }
+}
+
+// Blocks until `job` has exited or stopped, reaping whatever else finishes
+void job_wait(struct Job* job){
+    struct rusage usage;
+    long long span;
+    pid_t pid;
+    int status;
+
+    while(job_state(job) == JOB_RUNNING){
+        span = trace_begin();
+        pid = wait4(-1, &status, WUNTRACED, &usage);
+        trace_end(span, "waitpid", job->command);
+        if(pid < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        job_update(pid, status, &usage);
+    }
+}
+
+// TIMING
+
+long long jshell_slow_ms = 0;    // log commands slower than this, 0 is off
+
+double timespec_ms(struct timespec* from, struct timespec* to){
+    return (to->tv_sec - from->tv_sec)*1e3 + (to->tv_nsec - from->tv_nsec)/1e6;
+}
+
+double timeval_ms(struct timeval* tv){
+    return tv->tv_sec*1e3 + tv->tv_usec/1e3;
+}
+
+void time_report(double real_ms, struct rusage* usage){
+    fprintf(stderr, "\nreal    %.3fs\n", real_ms/1e3);
+    fprintf(stderr, "user    %.3fs\n", timeval_ms(&usage->ru_utime)/1e3);
+    fprintf(stderr, "sys     %.3fs\n", timeval_ms(&usage->ru_stime)/1e3);
+    fprintf(stderr, "maxrss  %ldK\n", usage->ru_maxrss);
+    fprintf(stderr, "ctxsw   %ld voluntary, %ld involuntary\n", usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Wall time of the whole job, until its last process was reaped
+double job_elapsed_ms(struct Job* job){
+    struct timespec* end = &job->start;
+    int i;
+
+    for(i=0; i<job->n_procs; i++){
+        if(timespec_ms(end, &job->procs[i].end) > 0){
+            end = &job->procs[i].end;
+        }
+    }
+    return timespec_ms(&job->start, end);
+}
+
+// Prints the `time` report of a finished job and logs it when it was slow
+void job_account(struct Job* job){
+    struct rusage total;
+    struct JobProcess* proc;
+    double elapsed = job_elapsed_ms(job);
+    int i;
+
+    if(jshell_slow_ms && elapsed >= jshell_slow_ms){
+        fprintf(stderr, "jshell: slow command (%.1f ms): %s\n", elapsed, job->command);
+    }
+    if(!job->timed){
+        return;
+    }
+
+    memset(&total, 0, sizeof(total));
+    for(i=0; i<job->n_procs; i++){
+        proc = &job->procs[i];
+        timeradd(&total.ru_utime, &proc->usage.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &proc->usage.ru_stime, &total.ru_stime);
+        total.ru_maxrss = proc->usage.ru_maxrss > total.ru_maxrss ? proc->usage.ru_maxrss : total.ru_maxrss;
+        total.ru_nvcsw += proc->usage.ru_nvcsw;
+        total.ru_nivcsw += proc->usage.ru_nivcsw;
+    }
+    time_report(elapsed, &total);
+
+    if(job->n_procs < 2){
+        return;
+    }
+    fprintf(stderr, "%-5s %9s %9s %9s %9s %11s  %s\n", "stage", "real", "user", "sys", "maxrss", "ctxsw", "command");
+    for(i=0; i<job->n_procs; i++){
+        proc = &job->procs[i];
+        fprintf(stderr, "%-5d %8.3fs %8.3fs %8.3fs %8ldK %5ld/%-5ld  %s\n", i + 1,
+                timespec_ms(&job->start, &proc->end)/1e3,
+                timeval_ms(&proc->usage.ru_utime)/1e3, timeval_ms(&proc->usage.ru_stime)/1e3,
+                proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw,
+                proc->name ? proc->name : "");
+    }
+}
+
+// END TIMING
+
+void job_print(struct Job* job){
+    static const char* states[] = { "Running", "Stopped", "Done" };
+    int state = job_state(job);
+
+    printf("[%d]%c  %-8s %s\n", job->id, job->id == job_table.current ? '+' : ' ',
+           states[state], job->command);
+}
+
+// A background job is done and not reported yet
+int jobs_finished(){
+    int i;
+
+    for(i=0; i<job_table.capacity; i++){
+        if(job_table.jobs[i] && job_table.jobs[i]->background && job_state(job_table.jobs[i]) == JOB_DONE){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reports background jobs that finished and drops them from the table
+void jobs_notify(){
+    struct Job* job;
+    int i;
+
+    for(i=0; i<job_table.capacity; i++){
+        job = job_table.jobs[i];
+        if(job && job->background && job_state(job) == JOB_DONE){
+            if(jshell_interactive){
+                job_print(job);
+            }
+            job_account(job);
+            job_free(job);
+        }
+    }
+}
+
+void job_signal(struct Job* job, int sig){
+    int i;
+
+    if(job->pgid > 0){
+        kill(-job->pgid, sig);
+        return;
+    }
+    for(i=0; i<job->n_procs; i++){
+        if(job->procs[i].state != JOB_DONE){
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+void job_continue(struct Job* job){
+    int i;
+
+    for(i=0; i<job->n_procs; i++){
+        if(job->procs[i].state == JOB_STOPPED){
+            job->procs[i].state = JOB_RUNNING;
+        }
+    }
+    job_signal(job, SIGCONT);
+}
+
+// Gives `job` the terminal and waits for it. A job that stops is kept in
+// the table as a background job, one that finishes is freed.
+int job_foreground(struct Job* job, int resume){
+    if(jshell_interactive && job->pgid > 0){
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if(resume){
+        job_continue(job);
+    }
+
+    job_wait(job);
+
+    if(jshell_interactive){
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if(job_state(job) == JOB_STOPPED){
+        job->background = 1;
+        job_table.current = job->id;
+        printf("\n");
+        job_print(job);
+        jshell_status = 128 + SIGTSTP;
+        return JSHELL_SUCCESS;
+    }
+
+    jshell_status = job_status(job);
+    job_account(job);
+    job_free(job);
+    return JSHELL_SUCCESS;
+}
+
+// END JOBS
+
+// EVENTS
+
+#define EVENT_NONE 0
+#define EVENT_URING 1
+#define EVENT_EPOLL 2
+#define EVENT_IGNORE (~0ULL)    // user_data of removals, their completions mean nothing
+#define EVENT_READ (1ULL << 63)    // marks the tags of reads
+
+struct EventLoop event_loop = { EVENT_NONE, -1 };
+
+int event_uring_setup(){
+    struct EventLoop* loop = &event_loop;
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(&params, 0, sizeof(params));
+    loop->fd = syscall(__NR_io_uring_setup, JSHELL_EVENT_RING_SIZE, &params);
+    if(loop->fd < 0){
+        return -1;
+    }
+    if(!(params.features & IORING_FEAT_FAST_POLL)){
+        // reads of empty pipes would tie up kernel threads, 5.7 polls them
+        close(loop->fd);
+        loop->fd = -1;
+        return -1;
+    }
+    fcntl(loop->fd, F_SETFD, FD_CLOEXEC);
+
+    loop->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    loop->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(loop->cq_ring_size > loop->sq_ring_size){
+            loop->sq_ring_size = loop->cq_ring_size;
+        }
+        loop->cq_ring_size = 0;
+    }
+    loop->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    loop->sq_ring = mmap(NULL, loop->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         loop->fd, IORING_OFF_SQ_RING);
+    loop->cq_ring = loop->sq_ring;
+    if(loop->sq_ring != MAP_FAILED && loop->cq_ring_size){
+        loop->cq_ring = mmap(NULL, loop->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             loop->fd, IORING_OFF_CQ_RING);
+    }
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQES);
+    if(loop->sq_ring == MAP_FAILED || loop->cq_ring == MAP_FAILED || loop->sqes == MAP_FAILED){
+        if(loop->sq_ring != MAP_FAILED){
+            munmap(loop->sq_ring, loop->sq_ring_size);
+        }
+        if(loop->cq_ring_size && loop->cq_ring != MAP_FAILED){
+            munmap(loop->cq_ring, loop->cq_ring_size);
+        }
+        if(loop->sqes != MAP_FAILED){
+            munmap(loop->sqes, loop->sqes_size);
+        }
+        close(loop->fd);
+        loop->fd = -1;
+        return -1;
+    }
+
+    sq = loop->sq_ring;
+    cq = loop->cq_ring;
+    loop->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    loop->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    loop->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    loop->sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    loop->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    loop->cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Picks the backend on first use. JSHELL_EVENTS=epoll skips io_uring.
+void event_init(){
+    const char* backend;
+
+    if(event_loop.backend != EVENT_NONE){
+        return;
+    }
+    backend = env_get("JSHELL_EVENTS");
+    if((!backend || strcmp(backend, "epoll") != 0) && event_uring_setup() == 0){
+        event_loop.backend = EVENT_URING;
+        return;
+    }
+    event_loop.fd = epoll_create1(EPOLL_CLOEXEC);
+    if(event_loop.fd < 0){
+        raise_error("Failed creation of the event loop.");
+    }
+    event_loop.backend = EVENT_EPOLL;
+}
+
+// Drops the loop, for forked children that must not share the parent's
+void event_reset(){
+    int i;
+
+    if(event_loop.backend == EVENT_URING){
+        munmap(event_loop.sq_ring, event_loop.sq_ring_size);
+        if(event_loop.cq_ring_size){
+            munmap(event_loop.cq_ring, event_loop.cq_ring_size);
+        }
+        munmap(event_loop.sqes, event_loop.sqes_size);
+    }
+    if(event_loop.fd >= 0){
+        close(event_loop.fd);
+    }
+    for(i=0; i<event_loop.n_watches; i++){
+        free(event_loop.watches[i].buffer);
+    }
+    for(i=0; i<event_loop.n_retired; i++){
+        free(event_loop.retired[i].buffer);
+    }
+    free(event_loop.watches);
+    free(event_loop.arm);
+    free(event_loop.retired);
+    memset(&event_loop, 0, sizeof(event_loop));
+    event_loop.backend = EVENT_NONE;
+    event_loop.fd = -1;
+}
+
+// Submits everything queued without waiting
+void event_uring_submit(){
+    unsigned int pending = *event_loop.sq_tail - __atomic_load_n(event_loop.sq_head, __ATOMIC_ACQUIRE);
+
+    while(pending && syscall(__NR_io_uring_enter, event_loop.fd, pending, 0, 0, NULL, 0) < 0 && errno == EINTR);
+}
+
+// Queues one request, flushing the ring when it's full
+struct io_uring_sqe* event_uring_push(int opcode, int fd, unsigned int events, unsigned long long addr, unsigned long long data){
+    struct io_uring_sqe* sqe;
+    unsigned int tail = *event_loop.sq_tail;
+    unsigned int index;
+
+    if(tail - __atomic_load_n(event_loop.sq_head, __ATOMIC_ACQUIRE) == event_loop.sq_entries){
+        event_uring_submit();
+    }
+    index = tail & event_loop.sq_mask;
+    sqe = &event_loop.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->addr = addr;
+    sqe->user_data = data;
+    event_loop.sq_array[index] = index;
+    __atomic_store_n(event_loop.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Arms `fd` with the next wait
+void event_uring_queue(int fd){
+    if(event_loop.watches[fd].queued){
+        return;
+    }
+    if(event_loop.n_arm == event_loop.arm_capacity){
+        event_loop.arm_capacity = event_loop.arm_capacity ? 2*event_loop.arm_capacity : JSHELL_EVENT_RING_SIZE;
+        event_loop.arm = realloc(event_loop.arm, event_loop.arm_capacity*sizeof(int));
+        if(!event_loop.arm){
+            raise_error("Failed allocation of `event arm list`.");
+        }
+    }
+    event_loop.arm[event_loop.n_arm++] = fd;
+    event_loop.watches[fd].queued = 1;
+}
+
+unsigned long long event_uring_tag(int fd){
+    struct EventWatch* watch = &event_loop.watches[fd];
+
+    return (unsigned long long)(watch->generation & 0x7fffffff) << 32 | (unsigned int)fd | (watch->reading ? EVENT_READ : 0);
+}
+
+// The watch of `fd`, the table grows to hold it
+struct EventWatch* event_slot(int fd){
+    int n;
+
+    if(fd >= event_loop.n_watches){
+        n = event_loop.n_watches ? event_loop.n_watches : JSHELL_EVENT_RING_SIZE/4;
+        while(n <= fd){
+            n *= 2;
+        }
+        event_loop.watches = realloc(event_loop.watches, n*sizeof(struct EventWatch));
+        if(!event_loop.watches){
+            raise_error("Failed allocation of `event watches`.");
+        }
+        memset(event_loop.watches + event_loop.n_watches, 0, (n - event_loop.n_watches)*sizeof(struct EventWatch));
+        event_loop.n_watches = n;
+    }
+    return &event_loop.watches[fd];
+}
+
+// Stops the reads of `fd`. A read still in the ring is cancelled, the
+// kernel may write to its buffer until then, so the buffer is set aside.
+void event_read_stop(int fd){
+    struct EventWatch* watch = &event_loop.watches[fd];
+    struct EventRetired* retired;
+
+    if(event_loop.backend == EVENT_EPOLL){
+        if(watch->armed){
+            epoll_ctl(event_loop.fd, EPOLL_CTL_DEL, fd, NULL);
+        }
+    }
+    else if(watch->armed){
+        if(event_loop.n_retired == event_loop.retired_capacity){
+            event_loop.retired_capacity = event_loop.retired_capacity ? 2*event_loop.retired_capacity : JSHELL_EVENT_RING_SIZE/16;
+            event_loop.retired = realloc(event_loop.retired, event_loop.retired_capacity*sizeof(struct EventRetired));
+            if(!event_loop.retired){
+                raise_error("Failed allocation of `event retired list`.");
+            }
+        }
+        retired = &event_loop.retired[event_loop.n_retired++];
+        retired->tag = event_uring_tag(fd);
+        retired->buffer = watch->buffer;
+        watch->buffer = NULL;
+        event_uring_push(IORING_OP_ASYNC_CANCEL, -1, 0, retired->tag, EVENT_IGNORE);
+        event_uring_submit();
+    }
+    watch->armed = 0;
+    watch->reading = 0;
+    watch->generation++;
+}
+
+// Watches `fd` for the poll(2) bits in `events`, handing `data` back when
+// one of them is ready. Watching again replaces the previous request, 0 stops.
+// Ready fds keep being reported until they're drained, like poll(2).
+void event_watch(int fd, unsigned int events, unsigned long long data){
+    struct EventWatch* watch;
+
+    event_init();
+    if(fd >= event_loop.n_watches && !events){
+        return;
+    }
+    watch = event_slot(fd);
+    if(watch->reading){
+        event_read_stop(fd);
+    }
+
+    if(event_loop.backend == EVENT_EPOLL){
+        struct epoll_event ev;
+
+        if(watch->armed && watch->events == events && watch->data == data){
+            return;
+        }
+        ev.events = events;
+        ev.data.u64 = fd;
+        if(!events){
+            if(watch->armed){
+                epoll_ctl(event_loop.fd, EPOLL_CTL_DEL, fd, NULL);
+            }
+            watch->armed = 0;
+        }
+        else{
+            epoll_ctl(event_loop.fd, watch->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+            watch->armed = 1;
+        }
+        watch->events = events;
+        watch->data = data;
+        return;
+    }
+
+    // the data is looked up when the completion comes in, only a change of
+    // events needs a new poll
+    watch->data = data;
+    if(watch->events == events){
+        return;
+    }
+    if(watch->armed){
+        event_uring_push(IORING_OP_POLL_REMOVE, -1, 0, event_uring_tag(fd), EVENT_IGNORE);
+        watch->armed = 0;
+        if(!events){
+            // the caller is about to close it, don't hold the file until the next wait
+            event_uring_submit();
+        }
+    }
+    watch->generation++;
+    watch->events = events;
+    if(events){
+        event_uring_queue(fd);
+    }
+}
+
+// Must come before close(2), an io_uring poll keeps the file alive
+void event_unwatch(int fd){
+    event_watch(fd, 0, 0);
+}
+
+// Reads `fd` once it has data, up to JSHELL_EVENT_READ_SIZE bytes. The
+// result comes back from event_wait() with `data`, call again for more.
+// With io_uring the read is in the ring: whatever is ready is read by the
+// kernel in the same io_uring_enter that waits, no read(2) per fd. With
+// epoll event_wait() does the read(2) itself. The fd must be blocking,
+// io_uring hands back EAGAIN for O_NONBLOCK instead of waiting.
+void event_read(int fd, unsigned long long data){
+    struct EventWatch* watch;
+    struct io_uring_sqe* sqe;
+
+    event_init();
+    watch = event_slot(fd);
+    if(watch->events){
+        event_watch(fd, 0, 0);
+    }
+    if(!watch->buffer){
+        watch->buffer = malloc(JSHELL_EVENT_READ_SIZE);
+        if(!watch->buffer){
+            raise_error("Failed allocation of `event read buffer`.");
+        }
+    }
+    watch->data = data;
+    watch->reading = 1;
+
+    if(event_loop.backend == EVENT_EPOLL){
+        struct epoll_event ev;
+
+        // one-shot, it stays quiet until the next call
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = fd;
+        epoll_ctl(event_loop.fd, watch->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+        watch->armed = 1;
+        return;
+    }
+    if(watch->armed){
+        return;
+    }
+    sqe = event_uring_push(IORING_OP_READ, fd, 0, (unsigned long long)(uintptr_t)watch->buffer, event_uring_tag(fd));
+    sqe->len = JSHELL_EVENT_READ_SIZE;
+    sqe->off = -1;    // the file position, pipes have none
+    watch->armed = 1;
+}
+
+// Moves completions to `events`. A poll is one-shot, its fd is queued to be
+// armed again so readiness behaves like epoll's level triggering.
+int event_uring_reap(struct Event* events, int max){
+    unsigned int head = *event_loop.cq_head;
+    unsigned int tail = __atomic_load_n(event_loop.cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe* cqe;
+    struct EventWatch* watch;
+    int n = 0;
+    int fd, i;
+
+    while(head != tail && n < max){
+        cqe = &event_loop.cqes[head & event_loop.cq_mask];
+        head++;
+        if(cqe->user_data == EVENT_IGNORE){
+            continue;
+        }
+        fd = (int)(cqe->user_data & 0xffffffff);
+        watch = fd < event_loop.n_watches ? &event_loop.watches[fd] : NULL;
+
+        if(cqe->user_data & EVENT_READ){
+            if(!watch || !watch->reading || !watch->armed || cqe->user_data != event_uring_tag(fd)){
+                // a cancelled read, its buffer can go now
+                for(i=0; i<event_loop.n_retired; i++){
+                    if(event_loop.retired[i].tag == cqe->user_data){
+                        free(event_loop.retired[i].buffer);
+                        event_loop.retired[i] = event_loop.retired[--event_loop.n_retired];
+                        break;
+                    }
+                }
+                continue;
+            }
+            watch->armed = 0;
+            events[n].data = watch->data;
+            events[n].events = POLLIN;
+            events[n].result = cqe->res;
+            events[n].buffer = watch->buffer;
+            n++;
+            continue;
+        }
+
+        if(!watch || cqe->user_data != event_uring_tag(fd) || !watch->events){
+            continue;    // unwatched or replaced since
+        }
+        watch->armed = 0;
+        event_uring_queue(fd);
+        if(cqe->res <= 0){
+            continue;
+        }
+        events[n].data = watch->data;
+        events[n].events = cqe->res;
+        events[n].result = 0;
+        events[n].buffer = NULL;
+        n++;
+    }
+    __atomic_store_n(event_loop.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Blocks until something watched is ready or a read is done. Returns how
+// many events were stored, 0 when a signal came first, -1 on errors.
+int event_wait(struct Event* events, int max){
+    struct EventWatch* watch;
+    unsigned int pending;
+    int n, i;
+
+    event_init();
+    if(event_loop.backend == EVENT_EPOLL){
+        struct epoll_event ready[JSHELL_SERVER_EVENTS];
+
+        n = epoll_wait(event_loop.fd, ready, max < JSHELL_SERVER_EVENTS ? max : JSHELL_SERVER_EVENTS, -1);
+        if(n < 0){
+            return errno == EINTR ? 0 : -1;
+        }
+        for(i=0; i<n; i++){
+            watch = &event_loop.watches[ready[i].data.u64];
+            events[i].data = watch->data;
+            events[i].events = ready[i].events;
+            events[i].result = 0;
+            events[i].buffer = NULL;
+            if(watch->reading){
+                // what io_uring would have done in the kernel
+                while((events[i].result = read(ready[i].data.u64, watch->buffer, JSHELL_EVENT_READ_SIZE)) < 0 && errno == EINTR);
+                if(events[i].result < 0){
+                    events[i].result = -errno;
+                }
+                events[i].events = POLLIN;
+                events[i].buffer = watch->buffer;
+            }
+        }
+        return n;
+    }
+
+    // the polls of the last round go out with this wait, in the same syscall
+    for(i=0; i<event_loop.n_arm; i++){
+        watch = &event_loop.watches[event_loop.arm[i]];
+        watch->queued = 0;
+        if(watch->events && !watch->armed){
+            event_uring_push(IORING_OP_POLL_ADD, event_loop.arm[i], watch->events,
+                             0, event_uring_tag(event_loop.arm[i]));
+            watch->armed = 1;
+        }
+    }
+    event_loop.n_arm = 0;
+
+    for(;;){
+        n = event_uring_reap(events, max);
+        pending = *event_loop.sq_tail - __atomic_load_n(event_loop.sq_head, __ATOMIC_ACQUIRE);
+        if(n > 0 && !pending){
+            return n;
+        }
+        if(syscall(__NR_io_uring_enter, event_loop.fd, pending, n ? 0 : 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0){
+            if(errno == EINTR){
+                return n;
+            }
+            return -1;
+        }
+        if(n > 0){
+            return n;
+        }
+    }
+}
+
+#define INPUT_READY 0
+#define INPUT_SIGCHLD 1
+
+// Waits in the event loop for input on `fd` at the prompt. Background jobs
+// that end meanwhile are reaped at once, and `notify` reports them rather
+// than leaving it to the next prompt. Both watches go again before it
+// returns, the loop is free for parallel then.
+void input_wait(int fd, void (*notify)()){
+    struct Event events[2];
+    int sigchld = subsystems[SUBSYSTEM_JOBS].ready ? job_table.sigchld_pipe[0] : -1;
+    int ready = 0;
+    int n, i;
+
+    event_watch(fd, POLLIN, INPUT_READY);
+    if(sigchld >= 0){
+        event_watch(sigchld, POLLIN, INPUT_SIGCHLD);
+    }
+    while(!ready){
+        n = event_wait(events, 2);
+        if(n < 0){
+            // the read that follows blocks instead
+            break;
+        }
+        for(i=0; i<n; i++){
+            if(events[i].data == INPUT_READY){
+                ready = 1;
+                continue;
+            }
+            jobs_reap(1);
+            if(jobs_finished()){
+                (*notify)();
+            }
+        }
+    }
+    event_unwatch(fd);
+    if(sigchld >= 0){
+        event_unwatch(sigchld);
+    }
+}
+
+// A pollable handle on a child, readable once it exits. -1 where the
+// kernel has no pidfds.
+int pidfd_open_pid(pid_t pid){
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// END EVENTS
+
+// PLACEMENT
+
+struct Topology topology = { NULL, NULL, 0, 0 };
+int placement_cgroup_fd = -1;    // stages spawned now go into this leaf
+
+// Parses "0-3,8,10-11" into `set`, -1 when it isn't a CPU list
+int cpu_list_parse(const char* text, cpu_set_t* set){
+    const char* p = text;
+    char* end;
+    long first, last;
+
+    CPU_ZERO(set);
+    do {
+        if(*p < '0' || *p > '9'){
+            return -1;
+        }
+        first = last = strtol(p, &end, 10);
+        if(*end == '-'){
+            p = end + 1;
+            if(*p < '0' || *p > '9'){
+                return -1;
+            }
+            last = strtol(p, &end, 10);
+        }
+        if(first > last || last >= CPU_SETSIZE){
+            return -1;
+        }
+        for(; first <= last; first++){
+            CPU_SET(first, set);
+        }
+        p = end;
+    } while(*p++ == ',');
+    return p[-1] == '\0' ? 0 : -1;
+}
+
+// A number from the cpu's sysfs topology directory, `missing` when it
+// has none
+long topology_read(int cpu, const char* name, long missing){
+    char path[128];
+    char value[32];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return missing;
+    }
+    n = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if(n <= 0){
+        return missing;
+    }
+    value[n] = '\0';
+    return strtol(value, NULL, 10);
+}
+
+// Sort key of one cpu: package, then hyperthreads after every core of
+// the package had one, then the core. Neighbours in this order are
+// different cores sharing a package, and its last level cache.
+struct TopologyCpu {
+    int cpu;
+    long package;
+    long thread;
+    long core;
+};
+
+int topology_compare(const void* a, const void* b){
+    const struct TopologyCpu* x = a;
+    const struct TopologyCpu* y = b;
+
+    if(x->package != y->package){
+        return x->package < y->package ? -1 : 1;
+    }
+    if(x->thread != y->thread){
+        return x->thread < y->thread ? -1 : 1;
+    }
+    if(x->core != y->core){
+        return x->core < y->core ? -1 : 1;
+    }
+    return x->cpu - y->cpu;
+}
+
+// Orders the CPUs the shell may run on for `pin auto`
+void topology_init(){
+    struct TopologyCpu* cpus;
+    cpu_set_t allowed;
+    int n = 0;
+    int i;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0){
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    cpus = calloc(CPU_COUNT(&allowed), sizeof(struct TopologyCpu));
+    topology.order = calloc(CPU_COUNT(&allowed), sizeof(int));
+    topology.packages = calloc(CPU_COUNT(&allowed), sizeof(long));
+    if(!cpus || !topology.order || !topology.packages){
+        raise_error("Failed allocation of `topology`.");
+    }
+    for(i=0; i<CPU_SETSIZE && n<CPU_COUNT(&allowed); i++){
+        if(!CPU_ISSET(i, &allowed)){
+            continue;
+        }
+        cpus[n].cpu = i;
+        cpus[n].package = topology_read(i, "physical_package_id", 0);
+        cpus[n].core = topology_read(i, "core_id", i);
+        // the list starts with the core's lowest numbered thread
+        cpus[n].thread = topology_read(i, "thread_siblings_list", i) != i;
+        n++;
+    }
+    qsort(cpus, n, sizeof(struct TopologyCpu), topology_compare);
+    for(i=0; i<n; i++){
+        topology.order[i] = cpus[i].cpu;
+        topology.packages[i] = cpus[i].package;
+    }
+    topology.count = n;
+    free(cpus);
+}
+
+// CPUs for the stages of an auto pipeline, adjacent stages on adjacent
+// cores. Pipelines take turns through the order, and one that would
+// straddle two packages starts over at the next package.
+void topology_pick(int* cpus, int n_stages){
+    int start = topology.cursor % topology.count;
+    int end = (start + n_stages - 1) % topology.count;
+    int i;
+
+    if(n_stages <= topology.count && topology.packages[start] != topology.packages[end]){
+        while(topology.packages[start] == topology.packages[(start + topology.count - 1) % topology.count]){
+            start = (start + 1) % topology.count;
+        }
+    }
+    for(i=0; i<n_stages; i++){
+        cpus[i] = topology.order[(start + i) % topology.count];
+    }
+    topology.cursor = start + n_stages;
+}
+
+// Creates the cgroup v2 leaf `name` below the shell's own cgroup and opens
+// its cgroup.procs, -1 with the error reported when that isn't possible
+int cgroup_leaf_open(const char* name){
+    char mount[PATH_MAX] = "";
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    char fstype[64];
+    char* self = NULL;
+    FILE* f;
+    int fd;
+
+    f = fopen("/proc/self/mountinfo", "re");
+    while(f && fgets(line, sizeof(line), f)){
+        // id parent major:minor root mountpoint options... - fstype source options
+        if(sscanf(line, "%*s %*s %*s %*s %4095s", path) == 1 && strstr(line, " - ") &&
+           sscanf(strstr(line, " - "), " - %63s", fstype) == 1 && strcmp(fstype, "cgroup2") == 0){
+            snprintf(mount, sizeof(mount), "%s", path);
+            break;
+        }
+    }
+    if(f){
+        fclose(f);
+    }
+    f = fopen("/proc/self/cgroup", "re");
+    while(f && fgets(line, sizeof(line), f)){
+        if(strncmp(line, "0::", 3) == 0){
+            line[strcspn(line, "\n")] = '\0';
+            self = line + 3;
+            break;
+        }
+    }
+    if(f){
+        fclose(f);
+    }
+    if(!*mount || !self){
+        fprintf(stderr, "jshell: pin: no cgroup v2 hierarchy\n");
+        return -1;
+    }
+
+    if(snprintf(path, sizeof(path), "%s%s/%s", mount, strcmp(self, "/") == 0 ? "" : self, name) >= (int)sizeof(path)){
+        fprintf(stderr, "jshell: pin: %s: %s\n", name, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if(mkdir(path, 0755) < 0 && errno != EEXIST){
+        fprintf(stderr, "jshell: pin: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    strncat(path, "/cgroup.procs", sizeof(path) - strlen(path) - 1);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd < 0){
+        fprintf(stderr, "jshell: pin: %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+// Sets up the placement of `plan` before its stages are spawned
+int placement_begin(struct Plan* plan, struct Placement* placement){
+    placement->active = 0;
+    placement->procs_fd = -1;
+    placement->cpus = NULL;
+    if(!plan->pin && !plan->cgroup){
+        return 0;
+    }
+
+    if(plan->pin){
+        if(sched_getaffinity(0, sizeof(placement->saved), &placement->saved) < 0){
+            fprintf(stderr, "jshell: pin: %s\n", strerror(errno));
+            return -1;
+        }
+        if(strcmp(plan->pin, "auto") == 0){
+            subsystem_need(SUBSYSTEM_TOPOLOGY);
+            placement->cpus = arena_alloc(&jshell_arena, plan->n_stages*sizeof(int));
+            topology_pick(placement->cpus, plan->n_stages);
+        }
+        else{
+            cpu_list_parse(plan->pin, &placement->set);
+            // a CPU that's offline or outside the shell's own set fails here,
+            // not once half of the pipeline runs
+            if(sched_setaffinity(0, sizeof(placement->set), &placement->set) < 0){
+                fprintf(stderr, "jshell: pin: %s: %s\n", plan->pin, strerror(errno));
+                return -1;
+            }
+        }
+        placement->active = 1;
+    }
+    if(plan->cgroup){
+        placement->procs_fd = cgroup_leaf_open(plan->cgroup);
+        if(placement->procs_fd < 0){
+            placement_end(placement);
+            return -1;
+        }
+        placement_cgroup_fd = placement->procs_fd;
+    }
+    return 0;
+}
+
+// Children inherit the affinity of the thread that forks them: the shell
+// takes on each stage's CPUs just before spawning it
+void placement_stage(struct Placement* placement, int stage){
+    cpu_set_t set;
+
+    if(!placement->cpus){
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(placement->cpus[stage], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// In a forked stage, before it runs anything: into the cgroup leaf
+void placement_enter(){
+    if(placement_cgroup_fd >= 0 && write(placement_cgroup_fd, "0", 1) < 0){
+        fprintf(stderr, "jshell: pin: cgroup: %s\n", strerror(errno));
+        _exit(JSHELL_FAILED);
+    }
+}
+
+void placement_end(struct Placement* placement){
+    if(placement->active){
+        sched_setaffinity(0, sizeof(placement->saved), &placement->saved);
+        placement->active = 0;
+    }
+    if(placement->procs_fd >= 0){
+        close(placement->procs_fd);
+        placement->procs_fd = -1;
+        placement_cgroup_fd = -1;
+    }
+}
+
+// pin without a command shows the order auto placement goes through
+int jshell_pin(char **args){
+    int i;
+
+    if(args[1] != NULL){
+        fprintf(stderr, "jshell: pin: usage: pin [-g cgroup] cpus|auto cmd ...\n");
+        return JSHELL_USAGE;
+    }
+    subsystem_need(SUBSYSTEM_TOPOLOGY);
+    printf("auto:");
+    for(i=0; i<topology.count; i++){
+        printf(" %d", topology.order[i]);
+    }
+    printf("\n");
+    return JSHELL_SUCCESS;
+}
+
+// END PLACEMENT
+
+// COMMANDS
+
+// Opens the files the stage redirects to, fds[n] is -1 where fd n has none.
+// They are close-on-exec, they only reach a child through dup2.
+int redirect_open(struct Stage* stage, int fds[3]){
+    int i;
+
+    for(i=0; i<3; i++){
+        fds[i] = -1;
+    }
+    for(i=0; i<3; i++){
+        if(!stage->redirects[i].path){
+            continue;
+        }
+        fds[i] = open(stage->redirects[i].path, stage->redirects[i].flags | O_CLOEXEC, 0666);
+        if(fds[i] < 0){
+            fprintf(stderr, "jshell: %s: %s\n", stage->redirects[i].path, strerror(errno));
+            redirect_close(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void redirect_close(int fds[3]){
+    int i;
+
+    for(i=0; i<3; i++){
+        if(fds[i] >= 0){
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+// jshell_spawn() for a stage that has to be in a cgroup before it execs,
+// which posix_spawn can't do
+pid_t jshell_spawn_fork(const char* path, char** argv, char** envp, int in_fd, int out_fd, int err_fd, pid_t pgid){
+    struct sigaction dfl;
+    sigset_t signals;
+    long long span = trace_begin();
+    pid_t pid;
+
+    pid = fork();
+    if(pid != 0){
+        trace_end(span, "fork", argv[0]);
+    }
+    if(pid < 0){
+        fprintf(stderr, "jshell(\"%s\"): %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+    if(pid > 0){
+        if(pgid >= 0){
+            setpgid(pid, pgid ? pgid : pid);
+        }
+        return pid;
+    }
+
+    if(pgid >= 0){
+        setpgid(0, pgid);
+    }
+    placement_enter();
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &dfl, NULL);
+    sigaction(SIGQUIT, &dfl, NULL);
+    sigaction(SIGTSTP, &dfl, NULL);
+    sigaction(SIGTTIN, &dfl, NULL);
+    sigaction(SIGTTOU, &dfl, NULL);
+    sigaction(SIGCHLD, &dfl, NULL);
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+    if(in_fd >= 0 && in_fd != STDIN_FILENO){
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if(out_fd >= 0 && out_fd != STDOUT_FILENO){
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    if(err_fd >= 0 && err_fd != STDERR_FILENO){
+        dup2(err_fd, STDERR_FILENO);
+    }
+    execve(path, argv, envp);
+    fprintf(stderr, "jshell(\"%s\"): %s\n", argv[0], strerror(errno));
+    _exit(errno == ENOENT ? JSHELL_NOT_FOUND : 126);
+}
+
+// Launches argv with in_fd/out_fd/err_fd (-1 to inherit) as its stdin,
+// stdout and stderr. posix_spawn uses vfork semantics, so no page tables
+// are copied, and the program comes from the PATH cache, so there's no
+// execvp directory probing.
+// pgid: -1 keeps the shell's process group, 0 starts a new one.
+pid_t jshell_spawn(struct Stage *stage, int in_fd, int out_fd, int err_fd, pid_t pgid){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    char** argv = stage->argv;
+    char** envp = stage->n_assigns ? env_stage_envp(stage) : env_envp();
+    const char* path;
+    long long span;
+    pid_t pid;
+    int err;
+
+    if(!stage->path || stage->path_generation != path_cache.generation){
+        span = trace_begin();
+        stage->path = path_cache_lookup(argv[0]);
+        stage->path_generation = path_cache.generation;
+        trace_end(span, "path_lookup", argv[0]);
+    }
+    path = stage->path;
+    if(!path){
+        fprintf(stderr, "jshell(\"%s\"): %s\n", argv[0], strerror(ENOENT));
+        return -1;
+    }
+
+    // anything builtins printed has to come out before the child's output
+    fflush(stdout);
+
+    if(placement_cgroup_fd >= 0){
+        return jshell_spawn_fork(path, argv, envp, in_fd, out_fd, err_fd, pgid);
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if(in_fd >= 0 && in_fd != STDIN_FILENO){
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if(out_fd >= 0 && out_fd != STDOUT_FILENO){
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if(err_fd >= 0 && err_fd != STDERR_FILENO){
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    }
+
+    // undo the interactive shell's ignored signals and blocked nothing
+    posix_spawnattr_init(&attr);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTSTP);
+    sigaddset(&signals, SIGTTIN);
+    sigaddset(&signals, SIGTTOU);
+    sigaddset(&signals, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+    if(pgid >= 0){
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    }
+    else{
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    span = trace_begin();
+    err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    if(err == ENOENT && path != argv[0]){
+        // the cached program went away, resolve it again
+        path_cache_forget(argv[0]);
+        path = path_cache_lookup(argv[0]);
+        stage->path = path;
+        stage->path_generation = path_cache.generation;
+        if(path){
+            err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+        }
+    }
+    trace_end(span, "spawn", argv[0]);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if(err != 0){
+        fprintf(stderr, "jshell(\"%s\"): %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// A forked child that goes on running shell code: no terminal games in
+// there, and wakeups of its own
+void subshell_init(){
+    jshell_interactive = 0;
+    if(subsystems[SUBSYSTEM_JOBS].ready){
+        close(job_table.sigchld_pipe[0]);
+        close(job_table.sigchld_pipe[1]);
+        if(pipe2(job_table.sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0){
+            _exit(JSHELL_FAILED);
+        }
+    }
+    event_reset();
+    trace_fork();
+}
+
+// Runs a builtin or a function as a pipeline stage in a forked child,
+// writing straight to out_fd like any other stage.
+pid_t jshell_spawn_builtin(struct Stage *stage, int in_fd, int out_fd, int err_fd, pid_t pgid){
+    struct Function* function = function_lookup(stage->argv[0]);
+    struct sigaction dfl;
+    long long span;
+    pid_t pid;
+    int ret;
+
+    fflush(stdout);
+    span = trace_begin();
+    pid = fork();
+    if(pid != 0){
+        trace_end(span, "fork", stage->argv[0]);
+    }
+    if(pid < 0){
+        fprintf(stderr, "jshell(\"%s\"): %s\n", stage->argv[0], strerror(errno));
+        return -1;
+    }
+    if(pid > 0){
+        // also done in the child, whichever runs first
+        if(pgid >= 0){
+            setpgid(pid, pgid ? pgid : pid);
+        }
+        return pid;
+    }
+
+    if(pgid >= 0){
+        setpgid(0, pgid);
+    }
+    placement_enter();
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &dfl, NULL);
+    sigaction(SIGQUIT, &dfl, NULL);
+    sigaction(SIGTSTP, &dfl, NULL);
+    sigaction(SIGTTIN, &dfl, NULL);
+    sigaction(SIGTTOU, &dfl, NULL);
+    sigaction(SIGCHLD, &dfl, NULL);
+    if(in_fd >= 0 && in_fd != STDIN_FILENO){
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if(err_fd >= 0 && err_fd != STDERR_FILENO){
+        dup2(err_fd, STDERR_FILENO);
+    }
+    if(out_fd >= 0 && out_fd != STDOUT_FILENO){
+        dup2(out_fd, STDOUT_FILENO);
+    }
+
+    subshell_init();
+    if(function){
+        ret = function_call(function, stage->argv);
+    }
+    else{
+        ret = (*stage->builtin->func)(stage->argv);
+    }
+    fflush(stdout);
+    trace_flush();
+    _exit(ret == JSHELL_EXIT_CODE ? jshell_status : ret);
+}
+
+// Exit status as the shell reports it, 128+n for a child killed by signal n
+int jshell_wait_status(int status){
+    if(WIFSIGNALED(status)){
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+int jshell_cd(char **args){
+    const char* dir = args[1];
+
+    if(dir == NULL) {
+        dir = env_get("HOME");
+        if(dir == NULL){
+            fprintf(stderr, "jshell: cd: HOME not set\n");
+            return JSHELL_FAILED;
+        }
+    }
+
+    if(chdir(dir) != 0) {
+        perror("jshell");
+        return JSHELL_FAILED;
+    }
+    if(jshell_interactive){
+        prompt_refresh_cwd();
+    }
+    return JSHELL_SUCCESS;
+}
+
+int jshell_help(char **args){
+    int i;
+    printf("\nJShell\n\n");
+    printf("--Piping can be done through '|' character.\n");
+    printf("Usage: \"cmd1 arg0 arg1 ... | cmd2 arg0 arg1 ... | cmd3 ...\"\n\n");
+    printf("--Double quotes can be used for arguments containing delimiters.\n\n");
+    printf("--A trailing '&' runs the command in background, see jobs, fg, bg and wait.\n\n");
+    printf("--\"pin 0-3 cmd | ...\" runs a pipeline on CPUs 0 to 3, \"pin auto\" puts its\n");
+    printf("  stages on neighbouring cores and \"pin -g name\" in a cgroup v2 leaf.\n\n");
+    printf("--Commands are separated by ';' or newlines. Scripts have if, while, until,\n");
+    printf("  for and functions: \"name() { ...; }\".\n\n");
+    printf("The following commands are built in:\n");
+
+    int n_builtins = jshell_num_builtins();
+    for (i = 0; i < n_builtins; i++) {
+        printf("> %s\n", builtins[i].name);
+    }
+    printf("\n");
+    
+    return JSHELL_SUCCESS;
+}
+
+int jshell_exit(char **args){
+  if(args[1] != NULL){
+      jshell_status = atoi(args[1]) & 0xff;
+  }
+  return JSHELL_EXIT_CODE;
+}
+
+int jshell_hash_builtin(char **args){
+    size_t i;
+    int ret = JSHELL_SUCCESS;
+
+    if(args[1] == NULL){
+        if(!path_cache.count){
+            printf("hash: hash table empty\n");
+            return JSHELL_SUCCESS;
+        }
+        printf("hits\tcommand\n");
+        for(i=0; i<path_cache.capacity; i++){
+            if(path_cache.entries[i].name){
+                printf("%4u\t%s\n", path_cache.entries[i].hits, path_cache.entries[i].path);
+            }
+        }
+        return JSHELL_SUCCESS;
+    }
+
+    if(strcmp(args[1], "-r") == 0){
+        path_cache_clear();
+        return JSHELL_SUCCESS;
+    }
+
+    for(i=1; args[i]!=NULL; i++){
+        if(!path_cache_lookup(args[i])){
+            fprintf(stderr, "jshell: hash: %s: not found\n", args[i]);
+            ret = JSHELL_FAILED;
+        }
+    }
+    return ret;
+}
+
+int jshell_jobs(char **args){
+    int i;
+
+    jobs_reap(0);
+    for(i=0; i<job_table.capacity; i++){
+        if(job_table.jobs[i] && job_table.jobs[i]->background){
+            job_print(job_table.jobs[i]);
+        }
+    }
+    return JSHELL_SUCCESS;
+}
+
+// Resolves a `%n` (or bare n) job argument, the current job when absent
+struct Job* job_argument(const char* name, const char* arg){
+    struct Job* job;
+    int i;
+
+    if(arg == NULL){
+        job = job_find(job_table.current);
+        for(i=job_table.capacity-1; !job && i>=0; i--){
+            if(job_table.jobs[i] && job_table.jobs[i]->background && job_state(job_table.jobs[i]) != JOB_DONE){
+                job = job_table.jobs[i];
+            }
+        }
+        if(!job){
+            fprintf(stderr, "jshell: %s: no current job\n", name);
+        }
+        return job;
+    }
+
+    job = job_find(atoi(arg[0] == '%' ? arg + 1 : arg));
+    if(!job || !job->background){
+        fprintf(stderr, "jshell: %s: %s: no such job\n", name, arg);
+        return NULL;
+    }
+    return job;
+}
+
+int jshell_fg(char **args){
+    struct Job* job = job_argument("fg", args[1]);
+
+    if(!job){
+        return JSHELL_FAILED;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    job->background = 0;
+    job_foreground(job, 1);
+    return jshell_status;
+}
+
+int jshell_bg(char **args){
+    struct Job* job = job_argument("bg", args[1]);
+
+    if(!job){
+        return JSHELL_FAILED;
+    }
+    job_continue(job);
+    job_table.current = job->id;
+    printf("[%d]+ %s &\n", job->id, job->command);
+    return JSHELL_SUCCESS;
+}
+
+// wait [%n | pid ...], every background job when no argument is given
+int jshell_wait(char **args){
+    struct Job* job;
+    int status = JSHELL_SUCCESS;
+    pid_t pid;
+    int i;
+
+    if(args[1] == NULL){
+        for(i=0; i<job_table.capacity; i++){
+            job = job_table.jobs[i];
+            if(job && job->background && job_state(job) == JOB_RUNNING){
+                job_wait(job);
+            }
+        }
+        return JSHELL_SUCCESS;
+    }
+
+    for(i=1; args[i]!=NULL; i++){
+        job = NULL;
+        if(args[i][0] == '%'){
+            job = job_argument("wait", args[i]);
+        }
+        else{
+            pid = atoi(args[i]);
+            job = pid > 0 ? job_find_pid(pid) : NULL;
+            if(job && !job->background){
+                job = NULL;
+            }
+            if(!job){
+                fprintf(stderr, "jshell: wait: pid %s is not a child of this shell\n", args[i]);
+            }
+        }
+
+        if(!job){
+            status = JSHELL_NOT_FOUND;
+            continue;
+        }
+        job_wait(job);
+        status = job_state(job) == JOB_DONE ? job_status(job) : 128 + SIGTSTP;
+    }
+    return status;
+}
+
+int jshell_cpu_count(){
+    cpu_set_t set;
+    long n;
+
+    if(sched_getaffinity(0, sizeof(set), &set) == 0){
+        return CPU_COUNT(&set);
+    }
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Copy of `word` with every "{}" replaced by `input`, NULL if it has none
+char* parallel_substitute(const char* word, const char* input){
+    const char* mark = strstr(word, "{}");
+    size_t input_length = strlen(input);
+    size_t n = 0;
+    char* out;
+    char* p;
+
+    if(!mark){
+        return NULL;
+    }
+    for(; mark; mark = strstr(mark + 2, "{}")){
+        n++;
+    }
+    out = p = arena_alloc(&jshell_arena, strlen(word) + n*input_length + 1);
+
+    while((mark = strstr(word, "{}"))){
+        memcpy(p, word, mark - word);
+        p += mark - word;
+        memcpy(p, input, input_length);
+        p += input_length;
+        word = mark + 2;
+    }
+    strcpy(p, word);
+    return out;
+}
+
+// Takes what one event_read() of the slot's grouped output brought and
+// asks for more, returns 0 on EOF
+int parallel_read(struct ParallelSlot* slot, struct Event* event){
+    if(event->result > 0){
+        if(slot->capacity - slot->length < (size_t)event->result){
+            slot->capacity = slot->capacity ? slot->capacity : JSHELL_READ_BUFFER_SIZE;
+            while(slot->capacity - slot->length < (size_t)event->result){
+                slot->capacity *= 2;
+            }
+            slot->output = realloc(slot->output, slot->capacity);
+            if(!slot->output){
+                raise_error("Failed allocation of `parallel output`.");
+            }
+        }
+        memcpy(slot->output + slot->length, event->buffer, event->result);
+        slot->length += event->result;
+    }
+    if(event->result > 0 || event->result == -EAGAIN || event->result == -EINTR){
+        event_read(slot->out_fd, event->data);
+        return 1;
+    }
+    event_unwatch(slot->out_fd);
+    close(slot->out_fd);
+    slot->out_fd = -1;
+    return 0;
+}
+
+// Frees the slot once its command exited and all its output is in, returns
+// the exit status or -1 while it's still going
+int parallel_collect(struct ParallelSlot* slot){
+    int status;
+
+    if(slot->out_fd >= 0 || job_state(slot->job) != JOB_DONE){
+        return -1;
+    }
+    if(slot->pid_fd >= 0){
+        event_unwatch(slot->pid_fd);
+        close(slot->pid_fd);
+        slot->pid_fd = -1;
+    }
+    if(slot->length){
+        fwrite(slot->output, 1, slot->length, stdout);
+        fflush(stdout);
+    }
+    status = job_status(slot->job);
+    job_free(slot->job);
+    slot->job = NULL;
+    return status;
+}
+
+// event data of parallel: the slot shifted left, the low bit set for its pidfd
+#define PARALLEL_SIGCHLD (~0ULL)
+
+// parallel [-j N] [-g] cmd args... ::: input...
+// Runs `cmd args... input` for every input, at most N at a time (the number of
+// usable CPUs by default). "{}" in the arguments is replaced by the input
+// instead of appending it. With -g the stdout of each command is buffered and
+// written in one piece when it exits, so lines of different commands never mix.
+int jshell_parallel(char **args){
+    struct ParallelSlot* slots;
+    struct Event* events;
+    struct Stage stage;
+    struct rusage usage;
+    char** inputs;
+    int max_jobs = jshell_cpu_count();
+    int group = 0, sigchld_watched = 0, check_all;
+    int n_words, n_inputs, next = 0, running = 0, failed = 0, placed;
+    int pipefd[2] = { -1, -1 };
+    int i, j, k, n, status;
+    pid_t pid;
+
+    for(i=1; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++){
+        if(strcmp(args[i], "-g") == 0){
+            group = 1;
+        }
+        else if(strncmp(args[i], "-j", 2) == 0){
+            const char* value = args[i][2] ? args[i] + 2 : args[++i];
+            if(!value || atoi(value) < 1){
+                fprintf(stderr, "jshell: parallel: -j expects a positive number\n");
+                return JSHELL_USAGE;
+            }
+            max_jobs = atoi(value);
+        }
+        else{
+            fprintf(stderr, "jshell: parallel: unknown option '%s'\n", args[i]);
+            return JSHELL_USAGE;
+        }
+    }
+
+    for(n_words=0; args[i+n_words] && strcmp(args[i+n_words], JSHELL_PARALLEL_SEPARATOR) != 0; n_words++);
+    if(!n_words || !args[i+n_words]){
+        fprintf(stderr, "jshell: parallel: usage: parallel [-j N] [-g] cmd args... " JSHELL_PARALLEL_SEPARATOR " input...\n");
+        return JSHELL_USAGE;
+    }
+    inputs = args + i + n_words + 1;
+    for(n_inputs=0; inputs[n_inputs]; n_inputs++);
+    args += i;
+
+    slots = arena_alloc(&jshell_arena, max_jobs*sizeof(struct ParallelSlot));
+    memset(slots, 0, max_jobs*sizeof(struct ParallelSlot));
+    events = arena_alloc(&jshell_arena, (2*max_jobs + 1)*sizeof(struct Event));
+    memset(&stage, 0, sizeof(stage));
+
+    while(next < n_inputs || running){
+        // top up to max_jobs commands in flight
+        for(k=0; k<max_jobs && next < n_inputs; k++){
+            if(slots[k].job){
+                continue;
+            }
+
+            // each input may name a different program, so resolve it afresh
+            stage.path = NULL;
+            stage.argv = arena_alloc(&jshell_arena, (n_words + 2)*sizeof(char*));
+            placed = 0;
+            for(j=0; j<n_words; j++){
+                char* substituted = parallel_substitute(args[j], inputs[next]);
+                placed |= substituted != NULL;
+                stage.argv[j] = substituted ? substituted : args[j];
+            }
+            stage.argv[n_words] = placed ? NULL : inputs[next];
+            stage.argv[n_words + 1] = NULL;
+            next++;
+
+            if(group && pipe2(pipefd, O_CLOEXEC) < 0){
+                fprintf(stderr, "jshell: Pipe could not be initialized.\n");
+                failed++;
+                continue;
+            }
+            pid = jshell_spawn(&stage, -1, group ? pipefd[1] : -1, -1, -1);
+            if(group){
+                close(pipefd[1]);
+            }
+            if(pid < 0){
+                if(group){
+                    close(pipefd[0]);
+                }
+                failed++;
+                continue;
+            }
+
+            slots[k].job = job_create(stage.argv[0], 1);
+            slots[k].job->procs[0].pid = pid;
+            slots[k].job->procs[0].state = JOB_RUNNING;
+            slots[k].job->procs[0].name = NULL;
+            slots[k].job->n_procs = 1;
+            slots[k].job->last_spawned = 1;
+            slots[k].out_fd = group ? pipefd[0] : -1;
+            if(group){
+                event_read(slots[k].out_fd, (unsigned long long)k << 1);
+            }
+            slots[k].pid_fd = pidfd_open_pid(pid);
+            if(slots[k].pid_fd >= 0){
+                event_watch(slots[k].pid_fd, POLLIN, (unsigned long long)k << 1 | 1);
+            }
+            else if(!sigchld_watched){
+                // no pidfds, any SIGCHLD means looking at every slot
+                event_watch(job_table.sigchld_pipe[0], POLLIN, PARALLEL_SIGCHLD);
+                sigchld_watched = 1;
+            }
+            slots[k].length = 0;
+            running++;
+        }
+        if(!running){
+            continue;
+        }
+
+        // sleep until a child exits or grouped output arrives, then only
+        // the slots that woke up are looked at
+        n = event_wait(events, 2*max_jobs + 1);
+        if(n < 0){
+            perror("jshell: parallel");
+            break;
+        }
+
+        check_all = 0;
+        for(i=0; i<n; i++){
+            if(events[i].data == PARALLEL_SIGCHLD){
+                jobs_reap(1);
+                check_all = 1;
+                continue;
+            }
+            k = events[i].data >> 1;
+            if(!slots[k].job){
+                continue;
+            }
+            if(events[i].data & 1){
+                pid = slots[k].job->procs[0].pid;
+                if(wait4(pid, &status, WNOHANG, &usage) == pid){
+                    job_update(pid, status, &usage);
+                }
+                // it stays readable, grouped output may still be coming
+                event_unwatch(slots[k].pid_fd);
+                close(slots[k].pid_fd);
+                slots[k].pid_fd = -1;
+            }
+            else if(slots[k].out_fd >= 0){
+                parallel_read(&slots[k], &events[i]);
+            }
+            if((status = parallel_collect(&slots[k])) >= 0){
+                failed += status != 0;
+                running--;
+            }
+        }
+        for(k=0; check_all && k<max_jobs; k++){
+            if(slots[k].job && (status = parallel_collect(&slots[k])) >= 0){
+                failed += status != 0;
+                running--;
+            }
+        }
+    }
+
+    if(sigchld_watched){
+        event_unwatch(job_table.sigchld_pipe[0]);
+    }
+    for(k=0; k<max_jobs; k++){
+        free(slots[k].output);
+    }
+    return failed ? JSHELL_FAILED : JSHELL_SUCCESS;
+}
+
+// `time cmd` is taken apart by the planner, this handles what's left:
+// `time -s ms` logs every command slower than ms (0 turns it off).
+int jshell_time(char **args){
+    if(args[1] != NULL && strcmp(args[1], "-s") == 0){
+        if(args[2] == NULL){
+            printf("%lld\n", jshell_slow_ms);
+            return JSHELL_SUCCESS;
+        }
+        jshell_slow_ms = atoll(args[2]);
+        return JSHELL_SUCCESS;
+    }
+    fprintf(stderr, "jshell: time: usage: time cmd args... | time -s [ms]\n");
+    return JSHELL_USAGE;
+}
+
+// echo [-n] [-e] args...
+int jshell_echo(char **args){
+    int newline = 1;
+    int escapes = 0;
+    char* c;
+    int i;
+
+    for(i=1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++){
+        if(strspn(args[i] + 1, "ne") != strlen(args[i] + 1)){
+            break;
+        }
+        newline &= strchr(args[i], 'n') == NULL;
+        escapes |= strchr(args[i], 'e') != NULL;
+    }
+
+    for(; args[i] != NULL; i++){
+        if(!escapes){
+            fputs(args[i], stdout);
+        }
+        else{
+            for(c=args[i]; *c; c++){
+                if(*c != '\\' || c[1] == '\0'){
+                    putchar(*c);
+                    continue;
+                }
+                switch(*++c){
+                    case 'n': putchar('\n'); break;
+                    case 't': putchar('\t'); break;
+                    case 'r': putchar('\r'); break;
+                    case 'a': putchar('\a'); break;
+                    case '\\': putchar('\\'); break;
+                    case 'c': return JSHELL_SUCCESS;    // no further output
+                    default: putchar('\\'); putchar(*c); break;
+                }
+            }
+        }
+        if(args[i+1] != NULL){
+            putchar(' ');
+        }
+    }
+    if(newline){
+        putchar('\n');
+    }
+    return JSHELL_SUCCESS;
+}
+
+int jshell_true(char **args){
+    return JSHELL_SUCCESS;
+}
+
+int jshell_false(char **args){
+    return JSHELL_FAILED;
+}
+
+// Parses a test(1) integer operand, prints an error when it isn't one
+int test_integer(const char* arg, long long* value){
+    char* end;
+
+    errno = 0;
+    *value = strtoll(arg, &end, 10);
+    if(errno || end == arg || *end != '\0'){
+        fprintf(stderr, "jshell: test: %s: integer expression expected\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+// Evaluates one test(1) expression of n words: 0 true, 1 false, 2 error
+int test_expression(char **args, int n){
+    struct stat st;
+    long long a, b;
+    const char* op;
+
+    if(n == 0){
+        return JSHELL_FAILED;
+    }
+    if(strcmp(args[0], "!") == 0){
+        int ret = test_expression(args + 1, n - 1);
+        return ret == JSHELL_USAGE ? ret : !ret;
+    }
+    if(n == 1){
+        return args[0][0] == '\0';
+    }
+
+    if(n == 2){
+        op = args[0];
+        if(op[0] != '-' || op[1] == '\0' || op[2] != '\0'){
+            fprintf(stderr, "jshell: test: %s: unary operator expected\n", op);
+            return JSHELL_USAGE;
+        }
+        switch(op[1]){
+            case 'n': return args[1][0] == '\0';
+            case 'z': return args[1][0] != '\0';
+            case 'e': return stat(args[1], &st) != 0;
+            case 'f': return stat(args[1], &st) != 0 || !S_ISREG(st.st_mode);
+            case 'd': return stat(args[1], &st) != 0 || !S_ISDIR(st.st_mode);
+            case 's': return stat(args[1], &st) != 0 || st.st_size == 0;
+            case 'L': return lstat(args[1], &st) != 0 || !S_ISLNK(st.st_mode);
+            case 'r': return access(args[1], R_OK) != 0;
+            case 'w': return access(args[1], W_OK) != 0;
+            case 'x': return access(args[1], X_OK) != 0;
+        }
+        fprintf(stderr, "jshell: test: %s: unary operator expected\n", op);
+        return JSHELL_USAGE;
+    }
+
+    if(n == 3){
+        op = args[1];
+        if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0){
+            return strcmp(args[0], args[2]) != 0;
+        }
+        if(strcmp(op, "!=") == 0){
+            return strcmp(args[0], args[2]) == 0;
+        }
+        if(op[0] == '-' && strlen(op) == 3){
+            if(test_integer(args[0], &a) < 0 || test_integer(args[2], &b) < 0){
+                return JSHELL_USAGE;
+            }
+            if(strcmp(op, "-eq") == 0) return !(a == b);
+            if(strcmp(op, "-ne") == 0) return !(a != b);
+            if(strcmp(op, "-lt") == 0) return !(a < b);
+            if(strcmp(op, "-le") == 0) return !(a <= b);
+            if(strcmp(op, "-gt") == 0) return !(a > b);
+            if(strcmp(op, "-ge") == 0) return !(a >= b);
+        }
+        fprintf(stderr, "jshell: test: %s: binary operator expected\n", op);
+        return JSHELL_USAGE;
+    }
+
+    fprintf(stderr, "jshell: test: too many arguments\n");
+    return JSHELL_USAGE;
+}
+
+// test expr: string, file and integer checks, with a leading ! to negate
+int jshell_test(char **args){
+    int n = 0;
+
+    while(args[n+1] != NULL){
+        n++;
+    }
+    return test_expression(args + 1, n);
+}
+
+// [ expr ], test with a closing bracket
+int jshell_bracket(char **args){
+    int n = 0;
+
+    while(args[n+1] != NULL){
+        n++;
+    }
+    if(n == 0 || strcmp(args[n], "]") != 0){
+        fprintf(stderr, "jshell: [: missing ']'\n");
+        return JSHELL_USAGE;
+    }
+    return test_expression(args + 1, n - 1);
+}
+
+int jshell_pwd(char **args){
+    char cwd[PATH_MAX];
+
+    if(!getcwd(cwd, sizeof(cwd))){
+        perror("jshell: pwd");
+        return JSHELL_FAILED;
+    }
+    printf("%s\n", cwd);
+    return JSHELL_SUCCESS;
+}
+
+// `command cmd args...` is resolved by the planner, which runs the program
+// instead of a builtin of the same name. This only sees a bare `command`.
+int jshell_command(char **args){
+    fprintf(stderr, "jshell: command: usage: command cmd args...\n");
+    return JSHELL_USAGE;
+}
+
+// history [n]      the last n entries, all by default
+// history -s text  entries containing text, newest first
+int jshell_history(char **args){
+    const char* entry;
+    size_t length;
+    int first = 0;
+    int id;
+
+    if(history_sync() < 0){
+        fprintf(stderr, "jshell: history: no history file\n");
+        return JSHELL_FAILED;
+    }
+
+    if(args[1] != NULL && strcmp(args[1], "-s") == 0){
+        if(args[2] == NULL){
+            fprintf(stderr, "jshell: history: usage: history [n] | history -s text\n");
+            return JSHELL_USAGE;
+        }
+        for(id=history_search(args[2], -1); id>=0; id=history_search(args[2], id)){
+            entry = history_entry(id, &length);
+            printf("%5d  %.*s\n", id + 1, (int)length, entry);
+        }
+        return JSHELL_SUCCESS;
+    }
+
+    if(args[1] != NULL && (unsigned int)atoi(args[1]) < history.count){
+        first = history.count - atoi(args[1]);
+    }
+    for(id=first; (unsigned int)id<history.count; id++){
+        entry = history_entry(id, &length);
+        printf("%5d  %.*s\n", id + 1, (int)length, entry);
+    }
+    return JSHELL_SUCCESS;
+}
+
+int env_compare(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// export [NAME[=value] ...], the exported variables when given no names
+int jshell_export(char **args){
+    char** envp;
+    char* equals;
+    size_t n = 0;
+    const char* value;
+    int i;
+
+    if(args[1] == NULL){
+        for(envp=env_envp(); envp[n]; n++);
+        envp = memcpy(arena_alloc(&jshell_arena, n*sizeof(char*)), env_envp(), n*sizeof(char*));
+        qsort(envp, n, sizeof(char*), env_compare);
+        for(i=0; i<(int)n; i++){
+            printf("export %s\n", envp[i]);
+        }
+        return JSHELL_SUCCESS;
+    }
+
+    for(i=1; args[i] != NULL; i++){
+        equals = strchr(args[i], '=');
+        if(equals){
+            env_set(args[i], equals - args[i], equals + 1, 1);
+        }
+        else if((value = env_get(args[i])) != NULL){
+            // the value lives in the entry that's about to be replaced
+            char* copy = strdup(value);
+            env_set(args[i], strlen(args[i]), copy, 1);
+            free(copy);
+        }
+    }
+    return JSHELL_SUCCESS;
+}
+
+int jshell_unset(char **args){
+    int i;
+
+    for(i=1; args[i] != NULL; i++){
+        env_unset(args[i]);
+    }
+    return JSHELL_SUCCESS;
+}
+
+int jshell_exec_pipe(struct Plan *plan){
+    struct Stage* stages = plan->stages;
+    int n_stages = plan->n_stages;
+    int pipefd[2];  //0: read; 1: write
+    int prev_read = -1;
+    int fds[3];
+    int in_fd, out_fd, err_fd;
+    struct Placement placement;
+    struct Job* job;
+    pid_t pid;
+    int i;
+
+    if(placement_begin(plan, &placement) < 0){
+        jshell_status = JSHELL_FAILED;
+        return JSHELL_FAILED;
+    }
+    job = job_create(plan->text, n_stages);
+    job->timed = plan->timed;
+
+    for(i=0; i<n_stages; i++){
+        pipefd[0] = pipefd[1] = -1;
         
-        dup2(pipefd[1], STDOUT_FILENO);
+        // close-on-exec, so children only keep the ends they dup2'd
+        if(i < n_stages-1 && pipe2(pipefd, O_CLOEXEC) < 0) {
+            fprintf(stderr, "jshell: Pipe could not be initialized.\n");
+            break;
+        }
+        // bigger pipes mean fewer context switches between the two ends, it's
+        // fine to stay at the default size when the limit doesn't allow it
+        if(pipefd[1] >= 0){
+            fcntl(pipefd[1], F_SETPIPE_SZ, JSHELL_PIPE_SIZE);
+        }
+
+        // redirections take the place of the pipe ends, like in sh
+        pid = -1;
+        job->failed_status = JSHELL_FAILED;
+        if(redirect_open(&stages[i], fds) == 0){
+            job->failed_status = JSHELL_NOT_FOUND;
+            in_fd = fds[0] >= 0 ? fds[0] : prev_read;
+            out_fd = fds[1] >= 0 ? fds[1] : pipefd[1];
+            err_fd = fds[2];
+            if(stages[i].err_to_out){
+                err_fd = out_fd >= 0 ? out_fd : STDOUT_FILENO;
+            }
+
+            // with job control the first command founds the pipeline's process group
+            placement_stage(&placement, i);
+            if(stages[i].builtin || function_lookup(stages[i].argv[0])){
+                pid = jshell_spawn_builtin(&stages[i], in_fd, out_fd, err_fd, jshell_interactive ? job->pgid : -1);
+            }
+            else{
+                pid = jshell_spawn(&stages[i], in_fd, out_fd, err_fd, jshell_interactive ? job->pgid : -1);
+            }
+            redirect_close(fds);
+        }
+        if(pid >= 0){
+            if(jshell_interactive && !job->pgid){
+                job->pgid = pid;
+            }
+            job->procs[job->n_procs].pid = pid;
+            job->procs[job->n_procs].state = JOB_RUNNING;
+            job->procs[job->n_procs].status = 0;
+            job->procs[job->n_procs].name = plan->timed ? strdup(stages[i].argv[0]) : NULL;
+            job->n_procs++;
+            job->last_spawned = i == n_stages - 1;
+        }
+
+        if(prev_read >= 0){
+            close(prev_read);
+        }
+        if(pipefd[1] >= 0){
+            close(pipefd[1]);
+        }
+        prev_read = pipefd[0];
+    }
+    if(prev_read >= 0){
+        close(prev_read);
+    }
+    placement_end(&placement);
+
+    if(!job->n_procs){
+        jshell_status = job->failed_status;
+        job_free(job);
+        return JSHELL_FAILED;
+    }
+
+    // every stage has been launched before the first wait
+    if(plan->background){
+        job->background = 1;
+        job_table.current = job->id;
+        if(jshell_interactive){
+            printf("[%d] %d\n", job->id, job->procs[job->n_procs-1].pid);
+        }
+        jshell_status = JSHELL_SUCCESS;
+        return JSHELL_SUCCESS;
+    }
+    return job_foreground(job, 0);
+}
+
+int jshell_cache(char **args){
+    if(args[1] != NULL && strcmp(args[1], "-c") == 0){
+        plan_cache_clear();
+        plan_cache.hits = plan_cache.misses = 0;
+        glob_cache_clear();
+        glob_cache.hits = glob_cache.misses = 0;
+        return JSHELL_SUCCESS;
+    }
+
+    printf("hits    %lu\n", plan_cache.hits);
+    printf("misses  %lu\n", plan_cache.misses);
+    printf("entries %d/%d\n", plan_cache.count, JSHELL_PLAN_CACHE_SIZE);
+    printf("dirs    %d/%d, %lu hits, %lu misses\n", glob_cache.count, JSHELL_GLOB_CACHE_SIZE/2, glob_cache.hits, glob_cache.misses);
+    return JSHELL_SUCCESS;
+}
+
+// Records `op path` on the stage, later ones win like in sh
+void redirect_add(struct Stage* stage, char* op, char* path){
+    int fd = op == jshell_op_in ? STDIN_FILENO : op == jshell_op_out || op == jshell_op_append ? STDOUT_FILENO : STDERR_FILENO;
+    int flags = O_RDONLY;
+
+    if(op == jshell_op_out || op == jshell_op_err){
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    else if(op == jshell_op_append || op == jshell_op_err_append){
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    stage->redirects[fd].path = path;
+    stage->redirects[fd].flags = flags;
+    if(fd == STDERR_FILENO){
+        stage->err_to_out = 0;
+    }
+}
+
+struct Plan* jshell_plan(char **args){
+    struct Plan* plan;
+    struct Stage* stages;
+    int n_stages = 0;
+    int max_stages = JSHELL_STAGE_BUFFER_SIZE;
+    char** tokens = args;
+    char* pin = NULL;
+    char* cgroup = NULL;
+    cpu_set_t set;
+    long long span;
+    int background = 0;
+    int timed = 0;
+    int i, w;
+
+    // `time cmd ...` times everything after it, options go to the builtin
+    if(strcmp(args[0], "time") == 0 && args[1] != NULL && args[1][0] != '-' && !is_operator_token(args[1])){
+        timed = 1;
+        args++;
+    }
+    // `pin [-g name] cpus|auto cmd ...` places every stage
+    if(strcmp(args[0], "pin") == 0){
+        i = 1;
+        if(args[i] != NULL && strcmp(args[i], "-g") == 0 && args[i+1] != NULL && !is_operator_token(args[i+1])){
+            cgroup = args[i+1];
+            i += 2;
+        }
+        if(args[i] != NULL && args[i+1] != NULL && !is_operator_token(args[i]) && !is_operator_token(args[i+1])){
+            if(strcmp(args[i], "auto") != 0 && cpu_list_parse(args[i], &set) < 0){
+                fprintf(stderr, "jshell: pin: %s: invalid CPU list\n", args[i]);
+                return NULL;
+            }
+            if(cgroup && (!*cgroup || strchr(cgroup, '/') || strcmp(cgroup, ".") == 0 || strcmp(cgroup, "..") == 0)){
+                fprintf(stderr, "jshell: pin: %s: invalid cgroup name\n", cgroup);
+                return NULL;
+            }
+            pin = args[i];
+            args += i + 1;
+        }
+        else{
+            cgroup = NULL;
+        }
+    }
+
+    // split into stages in one pass, each `|` becomes the previous stage's NULL.
+    // Redirections are taken out of argv, w is where the next word goes.
+    stages = arena_alloc(&jshell_arena, max_stages*sizeof(struct Stage));
+    memset(stages, 0, sizeof(struct Stage));
+    stages[n_stages++].argv = args;
+    for(i=0, w=0; args[i]!=NULL; i++){
+        if(args[i] == jshell_op_background){
+            if(args[i+1] != NULL || stages[n_stages-1].argv == args + w){
+                fprintf(stderr, "jshell: Syntax error for '&'.\n");
+                return NULL;
+            }
+            background = 1;
+            break;
+        }
+        if(args[i] == jshell_op_err_out){
+            stages[n_stages-1].err_to_out = 1;
+            continue;
+        }
+        if(is_operator_token(args[i]) && args[i] != jshell_op_pipe){
+            if(args[i+1] == NULL || is_operator_token(args[i+1])){
+                fprintf(stderr, "jshell: Syntax error for '%s'.\n", args[i]);
+                return NULL;
+            }
+            redirect_add(&stages[n_stages-1], args[i], args[i+1]);
+            i++;
+            continue;
+        }
+        if(args[i] != jshell_op_pipe){
+            args[w++] = args[i];
+            continue;
+        }
+        if(args[i+1] == NULL){
+            fprintf(stderr, "jshell: Right command expected for piping.\n");
+            return NULL;
+        }
+        if(stages[n_stages-1].argv == args + w || args[i+1] == jshell_op_pipe || args[i+1] == jshell_op_background){
+            fprintf(stderr, "jshell: Syntax error for '|'.\n");
+            return NULL;
+        }
+
+        if(n_stages >= max_stages){
+            struct Stage* grown = arena_alloc(&jshell_arena, 2*max_stages*sizeof(struct Stage));
+            memcpy(grown, stages, max_stages*sizeof(struct Stage));
+            stages = grown;
+            max_stages *= 2;
+        }
+        args[w++] = NULL;
+        memset(&stages[n_stages], 0, sizeof(struct Stage));
+        stages[n_stages++].argv = args + w;
+    }
+    plan = arena_alloc(&jshell_arena, sizeof(struct Plan));
+    plan->n_args = args + i + 1 - tokens;
+
+    // what the words were moved out of, so the plan cache only sees words
+    while(w <= i){
+        args[w++] = NULL;
+    }
+
+    for(w=0; w<n_stages; w++){
+        // leading NAME=value words are the command's environment
+        while(stages[w].argv[0] != NULL && is_assignment(stages[w].argv[0])){
+            if(!stages[w].n_assigns){
+                stages[w].assigns = stages[w].argv;
+            }
+            stages[w].n_assigns++;
+            stages[w].argv++;
+        }
+        if(stages[w].argv[0] == NULL && pin){
+            fprintf(stderr, "jshell: pin: Command expected.\n");
+            return NULL;
+        }
+        if(stages[w].argv[0] == NULL && stages[w].n_assigns && n_stages == 1 && !background){
+            // only assignments, they set shell variables
+            continue;
+        }
+        if(stages[w].argv[0] == NULL){
+            fprintf(stderr, "jshell: Command expected before redirection.\n");
+            return NULL;
+        }
+        if(strcmp(stages[w].argv[0], "command") == 0 && stages[w].argv[1] != NULL){
+            // forces the external program
+            stages[w].argv++;
+            continue;
+        }
+        span = trace_begin();
+        stages[w].builtin = builtin_lookup(stages[w].argv[0]);
+        trace_end(span, "builtin_lookup", stages[w].argv[0]);
+
+        // a pinned stage runs in a child, where cd or export would be lost.
+        // parallel, time and pin only start commands, that's fine there.
+        if(pin && stages[w].builtin && !stages[w].builtin->pure && stages[w].builtin->func != &jshell_parallel
+           && stages[w].builtin->func != &jshell_time && stages[w].builtin->func != &jshell_pin){
+            fprintf(stderr, "jshell: pin: %s changes the shell, it can't be pinned\n", stages[w].argv[0]);
+            return NULL;
+        }
+    }
+
+    plan->stages = stages;
+    plan->n_stages = n_stages;
+    plan->background = background;
+    plan->timed = timed;
+    plan->pin = pin;
+    plan->cgroup = cgroup;
+    plan->text = NULL;
+    return plan;
+}
+
+int jshell_exec_plan(struct Plan *plan){
+    struct Function* function;
+    long long span;
+    int ret;
+    int i;
+
+    if(plan->n_stages > 1 || plan->background || plan->pin){
+        return jshell_exec_pipe(plan);
+    }
+
+    if(plan->stages[0].argv[0] == NULL){
+        for(i=0; i<plan->stages[0].n_assigns; i++){
+            char* equals = strchr(plan->stages[0].assigns[i], '=');
+            env_set(plan->stages[0].assigns[i], equals - plan->stages[0].assigns[i], equals + 1, 0);
+        }
+        jshell_status = JSHELL_SUCCESS;
+        return JSHELL_SUCCESS;
+    }
+
+    // functions come before builtins, like in sh
+    function = function_lookup(plan->stages[0].argv[0]);
+    if(function || plan->stages[0].builtin){
+        struct timespec start, end;
+        struct rusage before, after;
+
+        int fds[3];
+        int saved[3];
+        int i;
+
+        if(redirect_open(&plan->stages[0], fds) < 0){
+            jshell_status = JSHELL_FAILED;
+            return JSHELL_FAILED;
+        }
+        if(plan->stages[0].err_to_out){
+            // 2>&1 wins over an earlier 2>file, which was opened all the same
+            if(fds[2] >= 0){
+                close(fds[2]);
+            }
+            fds[2] = fcntl(fds[1] >= 0 ? fds[1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        }
+        // builtins run in the shell, its own fds are swapped for the call
+        fflush(stdout);
+        fflush(stderr);
+        for(i=0; i<3; i++){
+            saved[i] = -1;
+            if(fds[i] >= 0){
+                saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+                dup2(fds[i], i);
+            }
+        }
+
+        if(plan->timed){
+            getrusage(RUSAGE_SELF, &before);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        // run builtin, if available
+        span = trace_begin();
+        if(function){
+            ret = function_call(function, plan->stages[0].argv);
+        }
+        else{
+            ret = (*plan->stages[0].builtin->func)(plan->stages[0].argv);
+        }
+        trace_end(span, function ? "function" : "builtin", plan->stages[0].argv[0]);
+        if(ret != JSHELL_EXIT_CODE){
+            jshell_status = ret;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        for(i=0; i<3; i++){
+            if(saved[i] >= 0){
+                dup2(saved[i], i);
+                close(saved[i]);
+            }
+        }
+        redirect_close(fds);
+
+        if(plan->timed){
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            getrusage(RUSAGE_SELF, &after);
+            fflush(stdout);
+            timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+            timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+            after.ru_nvcsw -= before.ru_nvcsw;
+            after.ru_nivcsw -= before.ru_nivcsw;
+            time_report(timespec_ms(&start, &end), &after);
+        }
+        return ret;
+    }
+    // run external, if no builtin match
+    return jshell_exec_pipe(plan);
+}
+
+int jshell_exec(char **args){
+    struct Plan* plan;
+
+    if(args[0] == NULL) {
+        // empty command
+        return JSHELL_SUCCESS;
+    }
+
+    plan = jshell_plan(args);
+    if(!plan){
+        return JSHELL_FAILED;
+    }
+    return jshell_exec_plan(plan);
+}
+
+// Tokenizes, plans and runs `line`, unless the same text was run recently
+// and its plan is still cached.
+int jshell_run_line(char *line){
+    size_t length = strlen(line);
+    unsigned long long hash = jshell_hash(line, length);
+    struct Plan* plan;
+    char** args;
+    char* raw;
+
+    // what $ references expand to changes from one run to the next
+    if(memchr(line, '$', length)){
+        raw = arena_alloc(&jshell_arena, length + 1);
+        memcpy(raw, line, length + 1);
+        args = split_line(line);
+        if(args == NULL){
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        if(args[0] == NULL){
+            return JSHELL_SUCCESS;
+        }
+        plan = jshell_plan(args);
+        if(!plan){
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        plan->text = raw;
+        return jshell_exec_plan(plan);
+    }
+
+    plan = plan_cache_lookup(line, length, hash);
+    if(plan){
+        return jshell_exec_plan(plan);
+    }
+
+    // the tokenizer overwrites the line, keep the text for the cache key
+    raw = arena_alloc(&jshell_arena, length + 1);
+    memcpy(raw, line, length + 1);
+
+    args = split_line(line);
+    if(args == NULL){
+        jshell_status = JSHELL_USAGE;
+        return JSHELL_FAILED;
+    }
+    if(args[0] == NULL) {
+        // empty command
+        return JSHELL_SUCCESS;
+    }
+
+    plan = jshell_plan(args);
+    if(!plan){
+        jshell_status = JSHELL_USAGE;
+        return JSHELL_FAILED;
+    }
+    plan->text = raw;
+    // what a pattern matches changes too, the tokens aren't in `line` either
+    if(!split_globbed){
+        plan = plan_cache_insert(raw, length, hash, plan, args, line);
+    }
+    return jshell_exec_plan(plan);
+}
+
+// Output of the command line `text` for $(...), trailing newlines dropped.
+// It runs like a subshell: a fork that shares nothing back, except for pure
+// builtins, which write straight into memory in the shell itself. The
+// result is malloc'd.
+char* jshell_capture(const char* text, size_t length, size_t* output_length){
+    struct Stage* stage = NULL;
+    struct Plan* plan = NULL;
+    struct Node* program;
+    char data[JSHELL_READ_BUFFER_SIZE];
+    char* output = NULL;
+    char* line;
+    char** args;
+    size_t capacity = 0;
+    FILE* saved;
+    FILE* out;
+    int pipefd[2];
+    int status;
+    ssize_t n;
+    pid_t pid;
+
+    *output_length = 0;
+#ifdef JSHELL_FUZZ
+    return calloc(1, 1);
+#endif
+    line = arena_alloc(&jshell_arena, length + 1);
+    memcpy(line, text, length);
+    line[length] = '\0';
+
+    // a single command is planned here, anything more runs in the child
+    status = program_parse(line, &program);
+    if(status != PARSE_OK){
+        if(status == PARSE_INCOMPLETE){
+            fprintf(stderr, "jshell: Unexpected end of input.\n");
+        }
+        jshell_status = JSHELL_USAGE;
+        return calloc(1, 1);
+    }
+    if(!program || (program->type == NODE_COMMAND && !program->next)){
+        program = NULL;
+        args = split_line(line);
+        plan = args && args[0] ? jshell_plan(args) : NULL;
+        if(!plan){
+            jshell_status = !args ? JSHELL_USAGE : args[0] ? JSHELL_FAILED : JSHELL_SUCCESS;
+            return calloc(1, 1);
+        }
+        plan->text = line;
+        stage = &plan->stages[0];
+    }
+
+    if(plan && plan->n_stages == 1 && !plan->background && !plan->timed && stage->builtin && stage->builtin->pure &&
+       !stage->n_assigns && !stage->redirects[0].path && !stage->redirects[1].path &&
+       !stage->redirects[2].path && !stage->err_to_out && !function_lookup(stage->argv[0])){
+        fflush(stdout);
+        out = open_memstream(&output, output_length);
+        if(!out){
+            raise_error("Failed allocation of `substitution output`.");
+        }
+        saved = stdout;
+        stdout = out;
+        jshell_status = (*stage->builtin->func)(stage->argv);
+        fclose(out);
+        stdout = saved;
+    }
+    else{
+        if(pipe2(pipefd, O_CLOEXEC) < 0){
+            fprintf(stderr, "jshell: Pipe could not be initialized.\n");
+            jshell_status = JSHELL_FAILED;
+            return calloc(1, 1);
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, JSHELL_PIPE_SIZE);
+
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0){
+            dup2(pipefd[1], STDOUT_FILENO);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            subshell_init();
+            if(program){
+                if(program_plan(program) == 0){
+                    program_run(program);
+                }
+            }
+            else{
+                jshell_exec_plan(plan);
+            }
+            fflush(stdout);
+            trace_flush();
+            _exit(jshell_status);
+        }
         close(pipefd[1]);
-        
-        if(execvp(left_args[0], left_args) < 0) {
-            char* err_msg = (char*)malloc(JSHELL_GENERIC_LIMIT*sizeof(char));
-            sprintf(err_msg, "Failed execution of '%s'", left_args[0]);
-            perror(err_msg);
+        if(pid < 0){
+            perror("jshell");
+            close(pipefd[0]);
+            jshell_status = JSHELL_FAILED;
+            return calloc(1, 1);
+        }
+
+        for(;;){
+            n = read(pipefd[0], data, sizeof(data));
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n <= 0){
+                break;
+            }
+            if(*output_length + n + 1 > capacity){
+                capacity = capacity ? 2*capacity : JSHELL_READ_BUFFER_SIZE;
+                while(*output_length + n + 1 > capacity){
+                    capacity *= 2;
+                }
+                output = realloc(output, capacity);
+                if(!output){
+                    raise_error("Failed allocation of `substitution output`.");
+                }
+            }
+            memcpy(output + *output_length, data, n);
+            *output_length += n;
+        }
+        close(pipefd[0]);
+        while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        jshell_status = jshell_wait_status(status);
+        if(!output){
+            output = calloc(1, 1);
+        }
+    }
+
+    while(*output_length > 0 && output[*output_length - 1] == '\n'){
+        (*output_length)--;
+    }
+    output[*output_length] = '\0';
+    return output;
+}
+
+// END COMMANDS
+
+// SCRIPTING
+
+#define LEX_END 0
+#define LEX_WORD 1
+#define LEX_SEPARATOR 2    // ; & or newline
+
+#define CONTROL_NONE 0
+#define CONTROL_BREAK 1
+#define CONTROL_CONTINUE 2
+#define CONTROL_RETURN 3
+
+int jshell_control = CONTROL_NONE;    // break, continue or return on its way out
+int jshell_control_count = 0;         // loops break and continue still have to leave
+int jshell_loop_depth = 0;
+int jshell_function_depth = 0;
+
+struct FunctionTable function_table = { NULL, 0, 0 };
+struct Arena function_arena = { NULL, 0 };    // function bodies, never reset
+
+const char* const parse_then[] = { "then", NULL };
+const char* const parse_branch[] = { "elif", "else", "fi", NULL };
+const char* const parse_fi[] = { "fi", NULL };
+const char* const parse_do[] = { "do", NULL };
+const char* const parse_done[] = { "done", NULL };
+const char* const parse_brace[] = { "}", NULL };
+const char* const parse_closers[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+
+// Finds the next token of the source. Words are only delimited here, they
+// keep their quotes until split_line() expands the command they're in.
+int lex_next(struct Parser* p){
+    const char* text = p->text;
+    size_t i = p->pos;
+    size_t end;
+    char in_quotes = 0;
+
+    while(text[i] == ' ' || text[i] == '\t' || text[i] == '\r' || text[i] == '\a'){
+        i++;
+    }
+    if(text[i] == '#'){
+        while(text[i] && text[i] != '\n'){
+            i++;
+        }
+    }
+    p->start = i;
+    if(text[i] == '\0'){
+        p->pos = p->end = i;
+        return LEX_END;
+    }
+    if(text[i] == ';' || text[i] == '\n' || text[i] == '&'){
+        p->pos = p->end = i + 1;
+        return LEX_SEPARATOR;
+    }
+
+    for(; text[i]; i++){
+        if(text[i] == '$' && text[i+1] == '(' && in_quotes != '\''){
+            end = substitution_end(text, i + 2);
+            if(!end){
+                p->state = PARSE_INCOMPLETE;
+                return LEX_END;
+            }
+            i = end;
+            continue;
+        }
+        if(in_quotes){
+            in_quotes = text[i] == in_quotes ? 0 : in_quotes;
+            continue;
+        }
+        if(text[i] == '"' || text[i] == '\''){
+            in_quotes = text[i];
+            continue;
+        }
+        // the & of 2>&1 doesn't end anything
+        if(is_delimiter(text[i]) || text[i] == ';' || (text[i] == '&' && text[i-1] != '>')){
+            break;
+        }
+    }
+    if(in_quotes){
+        p->state = PARSE_INCOMPLETE;
+        return LEX_END;
+    }
+    p->pos = p->end = i;
+    return LEX_WORD;
+}
+
+// The last token is the word `keyword`
+int parse_is(struct Parser* p, const char* keyword){
+    size_t length = strlen(keyword);
+
+    return p->end - p->start == length && memcmp(p->text + p->start, keyword, length) == 0;
+}
+
+int parse_is_any(struct Parser* p, const char* const* keywords){
+    int i;
+
+    for(i=0; keywords && keywords[i]; i++){
+        if(parse_is(p, keywords[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// NUL terminated copy in the command arena
+char* script_copy(const char* text, size_t length){
+    char* copy = arena_alloc(&jshell_arena, length + 1);
+
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char* parse_copy(struct Parser* p, size_t start, size_t end){
+    return script_copy(p->text + start, end - start);
+}
+
+// Reports the last token, unless running out of input already explains it
+void parse_error(struct Parser* p){
+    if(p->state != PARSE_OK){
+        return;
+    }
+    if(p->start == p->end){
+        p->state = PARSE_INCOMPLETE;
+        return;
+    }
+    if(p->text[p->start] == '\n'){
+        fprintf(stderr, "jshell: Syntax error near newline.\n");
+    }
+    else{
+        fprintf(stderr, "jshell: Syntax error near '%.*s'.\n", (int)(p->end - p->start), p->text + p->start);
+    }
+    p->state = PARSE_ERROR;
+}
+
+// Consumes the word `keyword` if it comes next
+int parse_accept(struct Parser* p, const char* keyword){
+    size_t pos = p->pos;
+
+    if(lex_next(p) == LEX_WORD && parse_is(p, keyword)){
+        return 1;
+    }
+    p->pos = pos;
+    return 0;
+}
+
+int parse_expect(struct Parser* p, const char* keyword){
+    if(lex_next(p) == LEX_WORD && parse_is(p, keyword)){
+        return 1;
+    }
+    parse_error(p);
+    return 0;
+}
+
+// Skips ; and newlines
+void parse_separators(struct Parser* p){
+    size_t pos = p->pos;
+
+    while(lex_next(p) == LEX_SEPARATOR && p->text[p->start] != '&'){
+        pos = p->pos;
+    }
+    p->pos = pos;
+}
+
+int parse_is_name(const char* name, size_t length){
+    size_t i;
+
+    for(i=0; i<length; i++){
+        if(!(name[i] == '_' || (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+             (i > 0 && name[i] >= '0' && name[i] <= '9'))){
+            return 0;
+        }
+    }
+    return length > 0;
+}
+
+struct Node* parse_list(struct Parser* p, const char* const* stops);
+
+// A compound command ends its line, it can't be piped or backgrounded
+struct Node* parse_end(struct Parser* p, struct Node* node){
+    size_t pos = p->pos;
+    int token = lex_next(p);
+
+    if((token == LEX_SEPARATOR && p->text[p->start] == '&') || (token == LEX_WORD && !parse_is_any(p, parse_closers))){
+        parse_error(p);
+        return NULL;
+    }
+    p->pos = pos;
+    return node;
+}
+
+// Everything up to the next separator, a trailing & stays with it
+struct Node* parse_simple(struct Parser* p, struct Node* node){
+    size_t start, end;
+    size_t pos;
+    int token;
+
+    lex_next(p);
+    start = p->start;
+    end = p->end;
+    for(;;){
+        pos = p->pos;
+        token = lex_next(p);
+        if(token == LEX_WORD){
+            end = p->end;
+            continue;
+        }
+        if(token == LEX_SEPARATOR && p->text[p->start] == '&'){
+            end = p->end;
+        }
+        else{
+            p->pos = pos;
+        }
+        break;
+    }
+    if(p->state != PARSE_OK){
+        return NULL;
+    }
+    node->type = NODE_COMMAND;
+    node->text = parse_copy(p, start, end);
+    return node;
+}
+
+// if list; then list; [elif list; then list;]... [else list;] fi
+struct Node* parse_if(struct Parser* p, struct Node* node){
+    node->type = NODE_IF;
+    node->cond = parse_list(p, parse_then);
+    if(!node->cond || !parse_expect(p, "then")){
+        parse_error(p);
+        return NULL;
+    }
+    node->body = parse_list(p, parse_branch);
+    if(parse_accept(p, "elif")){
+        // the innermost one takes the fi
+        node->orelse = arena_alloc(&jshell_arena, sizeof(struct Node));
+        memset(node->orelse, 0, sizeof(struct Node));
+        return parse_if(p, node->orelse) ? node : NULL;
+    }
+    if(parse_accept(p, "else")){
+        node->orelse = parse_list(p, parse_fi);
+    }
+    return parse_expect(p, "fi") ? node : NULL;
+}
+
+// for name [in words...]; do list; done
+struct Node* parse_for(struct Parser* p, struct Node* node){
+    size_t start, end, pos;
+    int token;
+
+    node->type = NODE_FOR;
+    if(lex_next(p) != LEX_WORD || !parse_is_name(p->text + p->start, p->end - p->start)){
+        parse_error(p);
+        return NULL;
+    }
+    node->name = parse_copy(p, p->start, p->end);
+
+    pos = p->pos;
+    if(parse_accept(p, "in")){
+        start = end = p->pos;
+        while((token = lex_next(p)) == LEX_WORD){
+            end = p->end;
+        }
+        if(token != LEX_SEPARATOR || p->text[p->start] == '&'){
+            parse_error(p);
+            return NULL;
+        }
+        node->text = parse_copy(p, start, end);
+    }
+    else if(lex_next(p) != LEX_SEPARATOR || p->text[p->start] == '&'){
+        // for name do ... is fine too
+        p->pos = pos;
+    }
+    parse_separators(p);
+    if(!parse_expect(p, "do")){
+        return NULL;
+    }
+    node->body = parse_list(p, parse_done);
+    return parse_expect(p, "done") ? node : NULL;
+}
+
+// End of the name when the last word is name() or name(){, what follows
+// the parentheses is lexed again. 0 when it's something else.
+size_t parse_function_name(struct Parser* p){
+    const char* paren = memchr(p->text + p->start, '(', p->end - p->start);
+    size_t end;
+
+    if(!paren || paren[1] != ')' || !parse_is_name(p->text + p->start, paren - (p->text + p->start))){
+        return 0;
+    }
+    end = paren - p->text;
+    if(end + 2 < p->end && !(end + 3 == p->end && paren[2] == '{')){
+        return 0;
+    }
+    p->pos = end + 2;
+    return end;
+}
+
+// name() { list; }, the body is parsed again when the definition runs
+struct Node* parse_function(struct Parser* p, struct Node* node, size_t name_start, size_t name_end){
+    size_t start;
+
+    node->type = NODE_FUNCTION;
+    node->name = parse_copy(p, name_start, name_end);
+    parse_separators(p);
+    if(!parse_expect(p, "{")){
+        return NULL;
+    }
+    start = p->end;
+    node->body = parse_list(p, parse_brace);
+    if(!parse_expect(p, "}")){
+        return NULL;
+    }
+    node->text = parse_copy(p, start, p->start);
+    return node;
+}
+
+struct Node* parse_command(struct Parser* p){
+    struct Node* node = arena_alloc(&jshell_arena, sizeof(struct Node));
+    size_t pos = p->pos;
+    size_t start, end;
+
+    memset(node, 0, sizeof(struct Node));
+    if(lex_next(p) != LEX_WORD){
+        parse_error(p);
+        return NULL;
+    }
+    start = p->start;
+    end = p->end;
+
+    if(parse_is_any(p, parse_closers)){
+        parse_error(p);
+        return NULL;
+    }
+    if(parse_is(p, "if")){
+        node = parse_if(p, node);
+    }
+    else if(parse_is(p, "while") || parse_is(p, "until")){
+        node->type = NODE_WHILE;
+        node->negate = parse_is(p, "until");
+        node->cond = parse_list(p, parse_do);
+        if(!node->cond || !parse_expect(p, "do")){
+            parse_error(p);
+            return NULL;
+        }
+        node->body = parse_list(p, parse_done);
+        node = parse_expect(p, "done") ? node : NULL;
+    }
+    else if(parse_is(p, "for")){
+        node = parse_for(p, node);
+    }
+    else if(parse_is(p, "{")){
+        node->type = NODE_GROUP;
+        node->body = parse_list(p, parse_brace);
+        node = parse_expect(p, "}") ? node : NULL;
+    }
+    else if(parse_is(p, "function")){
+        if(lex_next(p) != LEX_WORD){
+            parse_error(p);
+            return NULL;
+        }
+        start = p->start;
+        end = parse_function_name(p);
+        if(!end){
+            if(!parse_is_name(p->text + start, p->end - start)){
+                parse_error(p);
+                return NULL;
+            }
+            end = p->end;
+            parse_accept(p, "()");
+        }
+        node = parse_function(p, node, start, end);
+    }
+    else if((end = parse_function_name(p))){
+        node = parse_function(p, node, start, end);
+    }
+    else if(parse_is_name(p->text + start, end - start) && parse_accept(p, "()")){
+        node = parse_function(p, node, start, end);
+    }
+    else{
+        p->pos = pos;
+        return parse_simple(p, node);
+    }
+    return node ? parse_end(p, node) : NULL;
+}
+
+// Commands up to one of the `stops`, which is left for the caller. Without
+// stops the list goes to the end of the text.
+struct Node* parse_list(struct Parser* p, const char* const* stops){
+    struct Node* head = NULL;
+    struct Node** tail = &head;
+    struct Node* node;
+    size_t pos;
+    int token;
+
+    for(;;){
+        parse_separators(p);
+        pos = p->pos;
+        token = lex_next(p);
+        if(token == LEX_END){
+            if(stops && p->state == PARSE_OK){
+                p->state = PARSE_INCOMPLETE;
+            }
+            return head;
+        }
+        p->pos = pos;
+        if(token == LEX_WORD && parse_is_any(p, stops)){
+            return head;
+        }
+        node = parse_command(p);
+        if(p->state != PARSE_OK){
+            return NULL;
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+}
+
+// Parses `text` into a list of commands, *program is NULL when there are
+// none. The text is only read, commands get copies of their source.
+int program_parse(const char* text, struct Node** program){
+    struct Parser p = { text, 0, 0, 0, PARSE_OK };
+
+    *program = parse_list(&p, NULL);
+    return p.state;
+}
+
+// Plans the commands that have nothing to expand, once for all the times
+// they run. Returns -1 on syntax errors the planner found.
+int program_plan(struct Node* node){
+    struct Plan* plan;
+    char** args;
+    char* line;
+
+    for(; node; node = node->next){
+        if(node->type == NODE_COMMAND && !strchr(node->text, '$')){
+            line = script_copy(node->text, strlen(node->text));
+            args = split_line(line);
+            if(!args){
+                return -1;
+            }
+            if(args[0] && !split_globbed){
+                plan = jshell_plan(args);
+                if(!plan){
+                    return -1;
+                }
+                plan->text = node->text;
+                node->plan = plan;
+            }
+        }
+        // function bodies are planned when they're defined
+        if(node->type != NODE_FUNCTION &&
+           (program_plan(node->cond) < 0 || program_plan(node->body) < 0 || program_plan(node->orelse) < 0)){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// After a loop's body, whether break, continue or return ends the loop
+int loop_control(){
+    int ends;
+
+    if(jshell_control == CONTROL_BREAK || jshell_control == CONTROL_CONTINUE){
+        if(--jshell_control_count > 0){
+            return 1;    // meant for an outer loop
+        }
+        ends = jshell_control == CONTROL_BREAK;
+        jshell_control = CONTROL_NONE;
+        return ends;
+    }
+    return jshell_control == CONTROL_RETURN;
+}
+
+int node_command(struct Node* node){
+    struct Plan* plan = node->plan;
+    char** args;
+    char* line;
+
+    if(!plan){
+        line = script_copy(node->text, strlen(node->text));
+        args = split_line(line);
+        if(args == NULL){
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        if(args[0] == NULL){
+            return JSHELL_SUCCESS;
+        }
+        plan = jshell_plan(args);
+        if(!plan){
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        plan->text = node->text;
+    }
+    return jshell_exec_plan(plan);
+}
+
+int node_while(struct Node* node){
+    struct ArenaMark mark;
+    int status = JSHELL_SUCCESS;
+    int ret = JSHELL_SUCCESS;
+
+    jshell_loop_depth++;
+    for(;;){
+        mark = arena_mark(&jshell_arena);
+        ret = program_run(node->cond);
+        if(ret != JSHELL_EXIT_CODE && !jshell_control && (jshell_status == 0) == node->negate){
+            arena_release(&jshell_arena, mark);
+            break;
+        }
+        if(ret != JSHELL_EXIT_CODE && !jshell_control){
+            ret = program_run(node->body);
+            status = jshell_status;
+        }
+        arena_release(&jshell_arena, mark);
+        if(ret == JSHELL_EXIT_CODE || loop_control()){
+            break;
+        }
+    }
+    jshell_loop_depth--;
+    jshell_status = status;
+    return ret;
+}
+
+int node_for(struct Node* node){
+    struct ArenaMark mark;
+    char** words;
+    char* line;
+    int ret = JSHELL_SUCCESS;
+    int n, i;
+
+    // the words are expanded once, before the first iteration
+    if(node->text){
+        line = script_copy(node->text, strlen(node->text));
+        words = split_line(line);
+        if(!words){
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        for(n=0; words[n]; n++);
+    }
+    else{
+        words = jshell_argv + 1;
+        n = jshell_argc - 1;
+    }
+
+    jshell_status = JSHELL_SUCCESS;
+    jshell_loop_depth++;
+    for(i=0; i<n; i++){
+        env_set(node->name, strlen(node->name), words[i], 0);
+        mark = arena_mark(&jshell_arena);
+        ret = program_run(node->body);
+        arena_release(&jshell_arena, mark);
+        if(ret == JSHELL_EXIT_CODE || loop_control()){
+            break;
+        }
+    }
+    jshell_loop_depth--;
+    return ret;
+}
+
+struct Function* function_slot(const char* name){
+    size_t mask = function_table.capacity - 1;
+    size_t i = jshell_hash(name, strlen(name)) & mask;
+
+    while(function_table.slots[i].name && strcmp(function_table.slots[i].name, name) != 0){
+        i = (i + 1) & mask;
+    }
+    return &function_table.slots[i];
+}
+
+struct Function* function_lookup(const char* name){
+    struct Function* function;
+
+    if(!function_table.count || !name){
+        return NULL;
+    }
+    function = function_slot(name);
+    return function->name ? function : NULL;
+}
+
+// Parses the body again into function_arena, where it outlives the line
+// that defined it. A redefinition leaves the old body there, unless it's
+// the same one again, as when a loop or sourced file defines it.
+int function_define(struct Node* node){
+    struct Function* old_slots = function_table.slots;
+    size_t old_capacity = function_table.capacity;
+    struct Function* function = function_lookup(node->name);
+    struct Arena saved = jshell_arena;
+    struct Function* slot;
+    struct Node* body;
+    char* text;
+    int state;
+    size_t i;
+
+    if(function && strcmp(function->text, node->text) == 0){
+        return JSHELL_SUCCESS;
+    }
+
+    jshell_arena = function_arena;
+    text = script_copy(node->text, strlen(node->text));
+    state = program_parse(text, &body);
+    if(state == PARSE_OK && program_plan(body) < 0){
+        state = PARSE_ERROR;
+    }
+    function_arena = jshell_arena;
+    jshell_arena = saved;
+    if(state != PARSE_OK){
+        return JSHELL_USAGE;
+    }
+
+    if(!function && 2*(function_table.count + 1) > function_table.capacity){
+        function_table.capacity = old_capacity ? 2*old_capacity : JSHELL_FUNCTION_TABLE_SIZE;
+        function_table.slots = calloc(function_table.capacity, sizeof(struct Function));
+        if(!function_table.slots){
+            raise_error("Failed allocation of `function table`.");
+        }
+        for(i=0; i<old_capacity; i++){
+            if(old_slots[i].name){
+                *function_slot(old_slots[i].name) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    slot = function_slot(node->name);
+    if(!slot->name){
+        slot->name = strdup(node->name);
+        if(!slot->name){
+            raise_error("Failed allocation of `function name`.");
+        }
+        function_table.count++;
+    }
+    slot->body = body;
+    slot->text = text;
+    return JSHELL_SUCCESS;
+}
+
+// Runs the function with argv as $0.. $#, $0 stays the shell's
+int function_call(struct Function* function, char** argv){
+    int saved_argc = jshell_argc;
+    char** saved_argv = jshell_argv;
+    int ret;
+    int n;
+
+    for(n=0; argv[n]; n++);
+    jshell_argv = arena_alloc(&jshell_arena, (n + 1)*sizeof(char*));
+    memcpy(jshell_argv, argv, (n + 1)*sizeof(char*));
+    if(saved_argc > 0){
+        jshell_argv[0] = saved_argv[0];
+    }
+    jshell_argc = n;
+
+    jshell_function_depth++;
+    ret = program_run(function->body);
+    jshell_function_depth--;
+    if(jshell_control == CONTROL_RETURN){
+        jshell_control = CONTROL_NONE;
+    }
+
+    jshell_argc = saved_argc;
+    jshell_argv = saved_argv;
+    return ret == JSHELL_EXIT_CODE ? ret : jshell_status;
+}
+
+// Runs a list of commands. Memory of each one is released when it's done,
+// a loop over thousands of files allocates no more than one iteration does.
+int program_run(struct Node* node){
+    struct ArenaMark mark;
+    int ret = JSHELL_SUCCESS;
+
+    for(; node && !jshell_control; node = node->next){
+        mark = arena_mark(&jshell_arena);
+        switch(node->type){
+            case NODE_COMMAND:
+                ret = node_command(node);
+                break;
+            case NODE_IF:
+                ret = program_run(node->cond);
+                if(ret == JSHELL_EXIT_CODE || jshell_control){
+                    break;
+                }
+                if(jshell_status != 0 && !node->orelse){
+                    jshell_status = JSHELL_SUCCESS;
+                    break;
+                }
+                ret = program_run(jshell_status == 0 ? node->body : node->orelse);
+                break;
+            case NODE_WHILE:
+                ret = node_while(node);
+                break;
+            case NODE_FOR:
+                ret = node_for(node);
+                break;
+            case NODE_FUNCTION:
+                ret = jshell_status = function_define(node);
+                break;
+            case NODE_GROUP:
+                ret = program_run(node->body);
+                break;
+        }
+        arena_release(&jshell_arena, mark);
+        if(ret == JSHELL_EXIT_CODE){
+            return ret;
+        }
+    }
+    return ret;
+}
+
+// Runs what starts with `line`. Constructs that are still open keep reading
+// lines until they're closed; a line that's a single command takes the
+// usual way through the plan cache.
+int jshell_run_source(char* line){
+    struct Node* program;
+    char* text = line;
+    char* next;
+    size_t length;
+    int state;
+
+    for(;;){
+        state = program_parse(text, &program);
+        if(state != PARSE_INCOMPLETE){
+            break;
+        }
+        // the reader reuses its buffer
+        if(text == line){
+            text = script_copy(line, strlen(line));
+        }
+        if(jshell_interactive){
+            fputs(JSHELL_CONTINUATION_PROMPT, stdout);
+            fflush(stdout);
+        }
+        next = jshell_interactive ? editor_read_line() : jshell_read_line();
+        if(next == NULL){
+            fprintf(stderr, "jshell: Unexpected end of input.\n");
+            jshell_status = JSHELL_USAGE;
+            return JSHELL_FAILED;
+        }
+        if(jshell_interactive){
+            history_add(next);
+        }
+        length = strlen(text);
+        line = arena_alloc(&jshell_arena, length + strlen(next) + 2);
+        memcpy(line, text, length);
+        line[length] = '\n';
+        strcpy(line + length + 1, next);
+        text = line;
+    }
+
+    if(state == PARSE_ERROR){
+        jshell_status = JSHELL_USAGE;
+        return JSHELL_FAILED;
+    }
+    if(!program){
+        return JSHELL_SUCCESS;
+    }
+    if(program->type == NODE_COMMAND && !program->next && text == line){
+        return jshell_run_line(line);
+    }
+    if(program_plan(program) < 0){
+        jshell_status = JSHELL_USAGE;
+        return JSHELL_FAILED;
+    }
+    return program_run(program);
+}
+
+// break [n], continue [n], return [n]: the loops and the function see
+// jshell_control on their way out
+int jshell_loop_control(char **args, int control){
+    int n = args[1] ? atoi(args[1]) : 1;
+
+    if(!jshell_loop_depth){
+        fprintf(stderr, "jshell: %s: only meaningful in a loop\n", args[0]);
+        return JSHELL_FAILED;
+    }
+    if(n < 1){
+        fprintf(stderr, "jshell: %s: %s: loop count out of range\n", args[0], args[1]);
+        return JSHELL_FAILED;
+    }
+    jshell_control = control;
+    jshell_control_count = n < jshell_loop_depth ? n : jshell_loop_depth;
+    return JSHELL_SUCCESS;
+}
+
+int jshell_break(char **args){
+    return jshell_loop_control(args, CONTROL_BREAK);
+}
+
+int jshell_continue(char **args){
+    return jshell_loop_control(args, CONTROL_CONTINUE);
+}
+
+int jshell_return(char **args){
+    if(!jshell_function_depth){
+        fprintf(stderr, "jshell: return: can only `return' from a function\n");
+        return JSHELL_FAILED;
+    }
+    jshell_control = CONTROL_RETURN;
+    return args[1] ? atoi(args[1]) & 255 : jshell_status;
+}
+
+// END SCRIPTING
+
+// END JSHELL
+
+// BENCHMARK
+
+// Reports go here, so benchmarks can point stdout at /dev/null
+FILE* bench_out;
+
+double bench_now_us(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+int bench_compare(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Latency percentiles of `samples` (microseconds), plus throughput in
+// MB/s when every iteration processed `bytes`, calls/s otherwise.
+void bench_report(const char* name, double* samples, int n, size_t bytes){
+    double total = 0;
+    int i;
+
+    for(i=0; i<n; i++){
+        total += samples[i];
+    }
+    qsort(samples, n, sizeof(double), bench_compare);
+
+    fprintf(bench_out, "%-24s %7d %10.2f %10.2f %10.2f %10.2f  ", name, n,
+           samples[n/2], samples[(int)(n*0.9)], samples[(int)(n*0.99)], samples[n-1]);
+    if(bytes){
+        fprintf(bench_out, "%9.1f MB/s\n", (double)bytes*n/total);
+    }
+    else{
+        fprintf(bench_out, "%9.0f /s\n", n*1e6/total);
+    }
+}
+
+void bench_split_line(const char* name, const char* line, int iterations){
+    size_t length = strlen(line);
+    char* copy = malloc(length + 1);
+    double* samples = malloc(iterations*sizeof(double));
+    double start;
+    int i;
+
+    if(!copy || !samples){
+        raise_error("Failed allocation of `bench buffers`.");
+    }
+    for(i=0; i<iterations; i++){
+        memcpy(copy, line, length + 1);
+        arena_reset(&jshell_arena);
+
+        start = bench_now_us();
+        split_line(copy);
+        samples[i] = bench_now_us() - start;
+    }
+    bench_report(name, samples, iterations, length);
+    free(copy);
+    free(samples);
+}
+
+void bench_run_line(const char* name, const char* line, int iterations){
+    size_t length = strlen(line);
+    char* copy = malloc(length + 1);
+    double* samples = malloc(iterations*sizeof(double));
+    double start;
+    int i;
+
+    if(!copy || !samples){
+        raise_error("Failed allocation of `bench buffers`.");
+    }
+    for(i=0; i<iterations; i++){
+        memcpy(copy, line, length + 1);
+        arena_reset(&jshell_arena);
+
+        start = bench_now_us();
+        jshell_run_line(copy);
+        samples[i] = bench_now_us() - start;
+    }
+    bench_report(name, samples, iterations, 0);
+    free(copy);
+    free(samples);
+}
+
+// Builds `count` copies of `word` separated by spaces
+char* bench_line(const char* word, int count){
+    size_t word_length = strlen(word);
+    char* line = malloc(count*(word_length + 1) + 1);
+    int i;
+
+    if(!line){
+        raise_error("Failed allocation of `bench line`.");
+    }
+    for(i=0; i<count; i++){
+        memcpy(line + i*(word_length + 1), word, word_length);
+        line[i*(word_length + 1) + word_length] = ' ';
+    }
+    line[count ? count*(word_length + 1) - 1 : 0] = '\0';
+    return line;
+}
+
+// jshell --bench [iterations]: parser, prompt and spawn latencies. Spawn
+// benchmarks run `iterations` times, the cheaper ones ten times as often.
+int jshell_bench(int iterations){
+    char long_word[4097];
+    char* line;
+    double* samples;
+    double start;
+    int devnull;
+    int i;
+
+    if(iterations < 1){
+        fprintf(stderr, "jshell: --bench: iterations must be positive\n");
+        return JSHELL_USAGE;
+    }
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    samples = malloc(10*iterations*sizeof(double));
+    if(!bench_out || devnull < 0 || !samples){
+        raise_error("Failed setup of the benchmarks.");
+    }
+    setvbuf(bench_out, NULL, _IOLBF, 0);
+
+    fprintf(bench_out, "%-24s %7s %10s %10s %10s %10s  %s\n", "benchmark (us)", "iters", "p50", "p90", "p99", "max", "throughput");
+
+    memset(long_word, 'x', sizeof(long_word) - 1);
+    long_word[sizeof(long_word) - 1] = '\0';
+    line = bench_line(long_word, 8);
+    bench_split_line("split_line long words", line, 10*iterations);
+    free(line);
+
+    line = bench_line("arg", 2000);
+    bench_split_line("split_line many tokens", line, 10*iterations);
+    free(line);
+
+    line = bench_line("\"quoted arg with spaces\"", 500);
+    bench_split_line("split_line quoting", line, 10*iterations);
+    free(line);
+
+    line = bench_line("a | b", 200);
+    bench_split_line("split_line pipes", line, 10*iterations);
+    free(line);
+
+    // the prompt and spawned commands write to /dev/null
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    start = bench_now_us();
+    prompt_init();
+    samples[0] = bench_now_us() - start;
+    for(i=1; i<10*iterations; i++){
+        start = bench_now_us();
+        show_prompt();
+        samples[i] = bench_now_us() - start;
+    }
+    fprintf(bench_out, "%-24s %7d %10.2f\n", "prompt_init", 1, samples[0]);
+    bench_report("show_prompt", samples + 1, 10*iterations - 1, 0);
+
+    // `command`, since true is a builtin now
+    bench_run_line("spawn true", "command true", iterations);
+    bench_run_line("2-stage pipeline", "command true | command true", iterations);
+    bench_run_line("6-stage pipeline", "command true | command true | command true | "
+                   "command true | command true | command true", iterations);
+    bench_run_line("builtin (true)", "true", 10*iterations);
+
+    fclose(bench_out);
+    free(samples);
+    return JSHELL_SUCCESS;
+}
+
+// Lines every --stress round runs: pipelines of programs and builtins,
+// substitutions, scripting and lines that fail in all the ways a line can.
+// None of them may leave an fd or heap memory behind.
+const char* stress_lines[] = {
+    "command true | command true | command true",
+    "echo stress | command cat | command wc -c",
+    "echo a | echo b | pwd",
+    "x=$(echo value | command tr a-z A-Z)",
+    "y=\"$(echo $x) $(pwd)\"",
+    "for i in 1 2 3; do echo $i; done | command cat",
+    "f() { echo $1 $#; return 3; }; f a b; echo $?",
+    "if false; then echo no; elif true; then echo yes; fi",
+    "i=0; while test $i != 3; do i=$(command expr $i + 1); done",
+    "echo /*",
+    "echo out > /dev/null 2>&1",
+    "command cat < /nonexistent",
+    "jshell-stress-no-such-command | command true",
+    "echo \"a\"b",
+    "echo a | | echo b",
+    "echo >",
+    "fi",
+    "break",
+    "pin auto command true | command true",
+};
+
+int stress_fds(){
+    struct dirent* entry;
+    DIR* dir = opendir("/proc/self/fd");
+    int n = 0;
+
+    while(dir && (entry = readdir(dir)) != NULL){
+        n += entry->d_name[0] != '.';
+    }
+    if(dir){
+        closedir(dir);
+    }
+    return n - 1;    // the directory's own
+}
+
+// Runs `line` the way jshell_loop() does
+void stress_run(const char* line){
+    size_t length = strlen(line);
+    char* copy = malloc(length + 1);
+
+    if(!copy){
+        raise_error("Failed allocation of `stress line`.");
+    }
+    memcpy(copy, line, length + 1);
+    arena_reset(&jshell_arena);
+    jobs_reap(0);
+    jobs_notify();
+    jshell_run_source(copy);
+    free(copy);
+}
+
+// One round: every line of stress_lines, then JSHELL_STRESS_JOBS pipelines
+// in the background at once and a wait for all of them
+int stress_round(){
+    int n_lines = sizeof(stress_lines)/sizeof(stress_lines[0]);
+    int i;
+
+    for(i=0; i<n_lines; i++){
+        stress_run(stress_lines[i]);
+    }
+    for(i=0; i<JSHELL_STRESS_JOBS; i++){
+        stress_run("command true | command true &");
+    }
+    stress_run("wait");
+    return n_lines + JSHELL_STRESS_JOBS + 1;
+}
+
+// jshell --stress [rounds [min_rate]]: runs the stress lines over and over
+// and fails when fds or heap memory grew from the first round to the
+// last, or when fewer than `min_rate` lines ran per second.
+int jshell_stress(int rounds, double min_rate){
+    long long fds_before, fds_after;
+    size_t heap_before, heap_after;
+    double start, seconds;
+    long long lines = 0;
+    int saved_err;
+    int devnull;
+    int failed = 0;
+    int i;
+
+    if(rounds < 1){
+        fprintf(stderr, "jshell: --stress: rounds must be positive\n");
+        return JSHELL_USAGE;
+    }
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    saved_err = dup(STDERR_FILENO);
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if(!bench_out || saved_err < 0 || devnull < 0){
+        raise_error("Failed setup of the stress run.");
+    }
+    setvbuf(bench_out, NULL, _IOLBF, 0);
+    fcntl(saved_err, F_SETFD, FD_CLOEXEC);
+    fcntl(fileno(bench_out), F_SETFD, FD_CLOEXEC);
+
+    // what the lines print, errors included, goes nowhere
+    fflush(stdout);
+    fflush(stderr);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+
+    // the first round fills the caches and tables that are meant to stay
+    stress_round();
+    arena_reset(&jshell_arena);
+    fds_before = stress_fds();
+    heap_before = mallinfo2().uordblks;
+
+    start = bench_now_us();
+    for(i=0; i<rounds; i++){
+        lines += stress_round();
+    }
+    seconds = (bench_now_us() - start)/1e6;
+    arena_reset(&jshell_arena);
+    fds_after = stress_fds();
+    heap_after = mallinfo2().uordblks;
+
+    fflush(stdout);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_err);
+
+    fprintf(bench_out, "%-10s %7s %9s %10s %12s %14s\n", "stress", "rounds", "lines", "lines/s", "fds", "heap (bytes)");
+    fprintf(bench_out, "%-10s %7d %9lld %10.0f %5lld->%-6lld %6zu->%zu\n", "", rounds, lines, lines/seconds,
+            fds_before, fds_after, heap_before, heap_after);
+    if(fds_after != fds_before){
+        fprintf(stderr, "jshell: --stress: %lld fds leaked\n", fds_after - fds_before);
+        failed = 1;
+    }
+    if(heap_after > heap_before + JSHELL_STRESS_HEAP_SLACK){
+        fprintf(stderr, "jshell: --stress: heap grew by %zu bytes\n", heap_after - heap_before);
+        failed = 1;
+    }
+    if(lines/seconds < min_rate){
+        fprintf(stderr, "jshell: --stress: %.0f lines/s, below %.0f\n", lines/seconds, min_rate);
+        failed = 1;
+    }
+    fclose(bench_out);
+    return failed ? JSHELL_FAILED : JSHELL_SUCCESS;
+}
+
+#ifdef JSHELL_FUZZ
+
+// libFuzzer entry point, built with
+//     clang -g -O1 -fsanitize=fuzzer,address -DJSHELL_FUZZ jshell.c -pthread
+// An input goes through the script parser, the tokenizer, the planner and
+// the plan cache. Nothing runs: $(...) expands to nothing in fuzz builds.
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size){
+    struct Node* program;
+    struct Plan* plan;
+    char** args;
+    char* line;
+    char* raw;
+    size_t length;
+
+    arena_reset(&jshell_arena);
+    raw = arena_alloc(&jshell_arena, size + 1);
+    memcpy(raw, data, size);
+    raw[size] = '\0';
+    length = strlen(raw);
+
+    program_parse(raw, &program);
+
+    line = arena_alloc(&jshell_arena, length + 1);
+    memcpy(line, raw, length + 1);
+    args = split_line(line);
+    if(args && args[0]){
+        plan = jshell_plan(args);
+        if(plan && !split_globbed && !memchr(raw, '$', length)){
+            plan = plan_cache_insert(raw, length, jshell_hash(raw, length), plan, args, line);
+            plan_cache_lookup(raw, length, jshell_hash(raw, length));
         }
-        exit(EXIT_FAILURE);
     }
-    else {  // parent
-        p2 = fork();
-        
-        if(p2 < 0) {
-            fprintf(stderr, "jshell: Fork failed.\n");
+    return 0;
+}
+
+#ifdef JSHELL_FUZZ_MAIN
+// For AFL and for replaying crashes without libFuzzer: each file named on
+// the command line is one input, stdin when there are none
+int main(int argc, char** argv){
+    char* data = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    ssize_t n;
+    int fd;
+    int i;
+
+    for(i = argc > 1 ? 1 : 0; i < argc; i++){
+        fd = argc > 1 ? open(argv[i], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+        if(fd < 0){
+            perror(argv[i]);
             return JSHELL_FAILED;
         }
-  
-        else if(p2 == 0) {
-            // close write end
-            close(pipefd[1]);
-            
-            dup2(pipefd[0], STDIN_FILENO);
-            close(pipefd[0]);
-            
-            if(execvp(right_args[0], right_args) < 0) {
-                char* err_msg = (char*)malloc(JSHELL_GENERIC_LIMIT*sizeof(char));
-                sprintf(err_msg, "Failed execution of '%s'", right_args[0]);
-                perror(err_msg);
-            }
-            exit(EXIT_FAILURE);
-        } 
-        else{			
-			do{
-				wpid1 = waitpid(p1, &status1, WUNTRACED);
-			} while(!WIFEXITED(status1) && !WIFSIGNALED(status1));
-			
-			do{
-				wpid2 = waitpid(p2, &status2, WUNTRACED);
-			} while(!WIFEXITED(status2) && !WIFSIGNALED(status2));
+        length = 0;
+        for(;;){
+            if(length == capacity){
+                capacity = capacity ? 2*capacity : JSHELL_READ_BUFFER_SIZE;
+                data = realloc(data, capacity);
+                if(!data){
+                    raise_error("Failed allocation of `fuzz input`.");
+                }
+            }
+            n = read(fd, data + length, capacity - length);
+            if(n <= 0){
+                break;
+            }
+            length += n;
         }
+        if(fd != STDIN_FILENO){
+            close(fd);
+        }
+        LLVMFuzzerTestOneInput((const uint8_t*)data, length);
     }
-    
+    free(data);
     return JSHELL_SUCCESS;
 }
+#endif
 
-int jshell_pipe(char **args){
-    char **left_args;
-    char **right_args;
-    
-    int i, j;
-    int sizeof_left = 0;
-    int sizeof_right;
-    
-    for(i=1; args[i]!=NULL; i++){
-        if(args[i][0]==JSHELL_PIPE[0]){
-            sizeof_left = i + 1;
+#endif
+
+// END BENCHMARK
+
+// SERVER
+
+void buffer_append(struct Buffer* buffer, const void* data, size_t length){
+    if(buffer->length + length > buffer->capacity){
+        buffer->capacity = buffer->capacity ? buffer->capacity : JSHELL_LINE_BUFFER_SIZE;
+        while(buffer->length + length > buffer->capacity){
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if(!buffer->data){
+            raise_error("Failed allocation of `buffer`.");
         }
     }
-    sizeof_right = i - sizeof_left + 1;
-    
-    // Shouldn't ever happen
-    if(sizeof_left == 0 || sizeof_right == 0){
-        return 1;
-    }    
-    
-    left_args = malloc(sizeof_left*sizeof(char*));
-    if(!left_args){
-        raise_error("Failed allocation of `left_args`.");
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void buffer_consume(struct Buffer* buffer, size_t length){
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+void frame_append(struct Buffer* buffer, char type, const void* data, size_t length){
+    unsigned char header[FRAME_HEADER];
+    uint32_t n = htonl(length);
+
+    header[0] = type;
+    memcpy(header + 1, &n, 4);
+    buffer_append(buffer, header, FRAME_HEADER);
+    buffer_append(buffer, data, length);
+}
+
+// Length of the payload of the complete frame at the start of `buffer`,
+// -1 until all of it has arrived
+long frame_complete(struct Buffer* buffer){
+    uint32_t n;
+
+    if(buffer->length < FRAME_HEADER){
+        return -1;
     }
-    
-    right_args = malloc(sizeof_right*sizeof(char*));
-    if(!right_args){
-        raise_error("Failed allocation of `right_args`.");
+    memcpy(&n, buffer->data + 1, 4);
+    n = ntohl(n);
+    return buffer->length - FRAME_HEADER >= n ? (long)n : -1;
+}
+
+// Writes all of `data`, for blocking fds
+int write_all(int fd, const char* data, size_t length){
+    ssize_t n;
+
+    while(length > 0){
+        n = write(fd, data, length);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        data += n;
+        length -= n;
     }
-    
-    for(i=0, j=0; args[i]!=NULL; i++){
-        if(args[i][0]==JSHELL_PIPE[0])
+    return 0;
+}
+
+struct ServerClient** server_clients = NULL;
+int server_capacity = 0;
+int server_listener = -1;
+int server_sigchld_watched = 0;
+
+// event data: the client's index and which of its fds woke up
+#define SERVER_SOCKET 0
+#define SERVER_STDOUT 1
+#define SERVER_STDERR 2
+#define SERVER_STDIN 3
+#define SERVER_PIDFD 4
+#define SERVER_LISTENER (~0ULL)
+#define SERVER_SIGCHLD (~1ULL)
+
+void server_watch(int fd, unsigned int events, int client, int kind){
+    event_watch(fd, events, (unsigned long long)client << 3 | kind);
+}
+
+void server_read(int fd, int client, int kind){
+    event_read(fd, (unsigned long long)client << 3 | kind);
+}
+
+void server_close_fd(int* fd){
+    if(*fd >= 0){
+        event_unwatch(*fd);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+void server_drop(int id){
+    struct ServerClient* client = server_clients[id];
+
+    server_close_fd(&client->fd);
+    server_close_fd(&client->in_fd);
+    server_close_fd(&client->out_fd);
+    server_close_fd(&client->err_fd);
+    if(client->worker > 0){
+        // nobody is listening anymore, reaped as usual
+        kill(-client->worker, SIGTERM);
+        return;
+    }
+    free(client->request.data);
+    free(client->input.data);
+    free(client->output.data);
+    free(client);
+    server_clients[id] = NULL;
+}
+
+// Sends what's pending, watches for writability while something is left.
+// Once the worker is done and everything is out, the connection is closed.
+void server_flush(int id){
+    struct ServerClient* client = server_clients[id];
+    ssize_t n;
+
+    while(client->fd >= 0 && client->output.length > 0){
+        n = send(client->fd, client->output.data, client->output.length, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR){
             continue;
-        if(i < sizeof_left)
-            left_args[i] = args[i];
-        else{
-            right_args[j] = args[i];
-            j++;
-		}
+        }
+        if(n < 0 && errno == EAGAIN){
+            break;
+        }
+        if(n <= 0){
+            server_drop(id);
+            return;
+        }
+        buffer_consume(&client->output, n);
+    }
+    if(client->fd < 0){
+        return;
+    }
+    server_watch(client->fd, POLLIN | (client->output.length ? POLLOUT : 0), id, SERVER_SOCKET);
+
+    // a client that caught up gets the worker's output again
+    if(client->throttled && client->output.length < JSHELL_CLIENT_BUFFER_LIMIT/2){
+        client->throttled = 0;
+        if(client->out_fd >= 0){
+            server_read(client->out_fd, id, SERVER_STDOUT);
+        }
+        if(client->err_fd >= 0){
+            server_read(client->err_fd, id, SERVER_STDERR);
+        }
+    }
+
+    if(client->worker < 0 && client->out_fd < 0 && client->err_fd < 0 && !client->exit_sent){
+        uint32_t code = htonl(client->status);
+
+        frame_append(&client->output, FRAME_EXIT, &code, 4);
+        client->exit_sent = 1;
+        server_flush(id);
+        return;
+    }
+    if(client->exit_sent && !client->output.length){
+        server_drop(id);
     }
-    left_args[sizeof_left-1] = NULL;    // NULL terminated arrays
-    right_args[sizeof_right-1] = NULL;
-    
-    return jshell_exec_pipe(left_args, right_args);
 }
 
-int jshell_exec(char **args){
-    int i;
+// Forks the worker for `command`. It runs like `jshell -c`, the state the
+// server built at startup (PATH cache, environment, builtin table) comes
+// along for free.
+void server_start(int id, char* command, size_t length){
+    struct ServerClient* client = server_clients[id];
+    int in[2], out[2], err[2];
+    pid_t pid;
 
-    if(args[0] == NULL) {
-        // empty command
-        return JSHELL_SUCCESS;
+    if(pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0){
+        client->status = JSHELL_FAILED;
+        client->worker = -1;
+        return;
     }
-    
-    for(i=0; args[i]!=NULL; i++){
-        if(args[i][0]==JSHELL_PIPE[0]){
-            if(strlen(args[i])>1 || i==0){
-                fprintf(stderr, "jshell: Syntax error for '|'.\n");
-                return JSHELL_FAILED;
+
+    pid = fork();
+    if(pid == 0){
+        char* text = malloc(length + 1);
+
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        // nothing is exec'd here, close-on-exec doesn't help
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        close(server_listener);
+        for(id=0; id<server_capacity; id++){
+            struct ServerClient* other = server_clients[id];
+            int* fds[5];
+            int j;
+
+            if(!other){
+                continue;
             }
-            if(args[i+1]==NULL){
-                fprintf(stderr, "jshell: Right command expected for piping.\n");
-                return JSHELL_FAILED;
+            // another worker's stdin only sees EOF if nobody else holds it
+            fds[0] = &other->fd;
+            fds[1] = &other->in_fd;
+            fds[2] = &other->out_fd;
+            fds[3] = &other->err_fd;
+            fds[4] = &other->pid_fd;
+            for(j=0; j<5; j++){
+                if(*fds[j] >= 0){
+                    close(*fds[j]);
+                }
             }
-            return jshell_pipe(args);
         }
-        
+        event_reset();
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+
+        // its own SIGCHLD pipe, the server's wakeups stay the server's
+        close(job_table.sigchld_pipe[0]);
+        close(job_table.sigchld_pipe[1]);
+        if(pipe2(job_table.sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0){
+            _exit(JSHELL_FAILED);
+        }
+        trace_fork();
+
+        memcpy(text, command, length);
+        text[length] = '\0';
+        reader_open_string(text);
+        jshell_loop();
+        fflush(stdout);
+        trace_flush();
+        _exit(jshell_status);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    if(pid < 0){
+        close(in[1]);
+        close(out[0]);
+        close(err[0]);
+        client->status = JSHELL_FAILED;
+        client->worker = -1;
+        return;
+    }
+    setpgid(pid, pid);
+
+    client->worker = pid;
+    client->in_fd = in[1];
+    client->out_fd = out[0];
+    client->err_fd = err[0];
+    // the output pipes stay blocking, they're read through the event loop
+    fcntl(client->in_fd, F_SETFL, O_NONBLOCK);
+    server_read(client->out_fd, id, SERVER_STDOUT);
+    server_read(client->err_fd, id, SERVER_STDERR);
+
+    client->pid_fd = pidfd_open_pid(pid);
+    if(client->pid_fd >= 0){
+        server_watch(client->pid_fd, POLLIN, id, SERVER_PIDFD);
     }
+    else if(!server_sigchld_watched){
+        event_watch(job_table.sigchld_pipe[0], POLLIN, SERVER_SIGCHLD);
+        server_sigchld_watched = 1;
+    }
+}
 
-    for (i = 0; i<jshell_num_builtins(); i++) {
-        if(strcmp(args[0], builtins[i].name) == 0) {
-            // run builtin, if available
-            return (*builtins[i].func)(args);
+// Feeds the worker's stdin without blocking
+void server_feed(int id){
+    struct ServerClient* client = server_clients[id];
+    ssize_t n;
+
+    if(client->in_fd < 0){
+        client->input.length = 0;
+        return;
+    }
+    while(client->input.length > 0){
+        n = write(client->in_fd, client->input.data, client->input.length);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN){
+            server_watch(client->in_fd, POLLOUT, id, SERVER_STDIN);
+            return;
         }
+        if(n <= 0){
+            // the command doesn't read what's left
+            server_close_fd(&client->in_fd);
+            client->input.length = 0;
+            return;
+        }
+        buffer_consume(&client->input, n);
+    }
+    event_unwatch(client->in_fd);
+    if(client->stdin_eof){
+        server_close_fd(&client->in_fd);
     }
-    // run external, if no builtin match
-    return jshell_run(args);
 }
 
-// END COMMANDS
+void server_read_client(int id){
+    struct ServerClient* client = server_clients[id];
+    char data[JSHELL_FRAME_SIZE];
+    ssize_t n;
+    long length;
 
-// END JSHELL
+    for(;;){
+        n = recv(client->fd, data, sizeof(data), 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN){
+            break;
+        }
+        if(n <= 0){
+            server_drop(id);
+            return;
+        }
+        buffer_append(&client->request, data, n);
+    }
+
+    while((length = frame_complete(&client->request)) >= 0){
+        char type = client->request.data[0];
+
+        if(type == FRAME_COMMAND && client->worker == 0){
+            server_start(id, client->request.data + FRAME_HEADER, length);
+        }
+        else if(type == FRAME_STDIN && length == 0){
+            client->stdin_eof = 1;
+        }
+        else if(type == FRAME_STDIN){
+            buffer_append(&client->input, client->request.data + FRAME_HEADER, length);
+        }
+        buffer_consume(&client->request, FRAME_HEADER + length);
+    }
+    server_feed(id);
+    server_flush(id);
+}
+
+// Frames what one read of the worker's stdout or stderr brought. The next
+// read is only asked for while the client keeps up.
+void server_read_worker(int id, int kind, struct Event* event){
+    struct ServerClient* client = server_clients[id];
+    int* fd = kind == SERVER_STDOUT ? &client->out_fd : &client->err_fd;
+
+    if(*fd < 0){
+        return;
+    }
+    if(event->result > 0){
+        frame_append(&client->output, kind == SERVER_STDOUT ? FRAME_STDOUT : FRAME_STDERR, event->buffer, event->result);
+    }
+    if(event->result <= 0 && event->result != -EAGAIN && event->result != -EINTR){
+        server_close_fd(fd);
+    }
+    else if(client->output.length >= JSHELL_CLIENT_BUFFER_LIMIT){
+        client->throttled = 1;
+    }
+    else{
+        server_read(*fd, id, kind);
+    }
+    server_flush(id);
+}
+
+// Records a reaped worker, its exit status goes out after its output
+void server_exited(int id, int status){
+    struct ServerClient* client = server_clients[id];
+
+    server_close_fd(&client->pid_fd);
+    client->worker = -1;
+    client->status = jshell_wait_status(status);
+    if(client->fd < 0){
+        // its client is gone
+        server_drop(id);
+        return;
+    }
+    // the status is sent once the pipes are drained
+    server_flush(id);
+}
+
+// Reaps what the pidfds didn't cover, on kernels without them
+void server_reap(){
+    char drain[64];
+    pid_t pid;
+    int status;
+    int id;
+
+    while(read(job_table.sigchld_pipe[0], drain, sizeof(drain)) > 0);
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+        for(id=0; id<server_capacity; id++){
+            if(server_clients[id] && server_clients[id]->worker == pid){
+                server_exited(id, status);
+                break;
+            }
+        }
+    }
+}
+
+void server_accept(int listener){
+    struct ServerClient* client;
+    int fd;
+    int id;
+
+    while((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        for(id=0; id<server_capacity && server_clients[id]; id++);
+        if(id == server_capacity){
+            server_capacity = server_capacity ? 2*server_capacity : JSHELL_SERVER_EVENTS;
+            server_clients = realloc(server_clients, server_capacity*sizeof(struct ServerClient*));
+            if(!server_clients){
+                raise_error("Failed allocation of `server clients`.");
+            }
+            memset(server_clients + id, 0, (server_capacity - id)*sizeof(struct ServerClient*));
+        }
+        client = calloc(1, sizeof(struct ServerClient));
+        if(!client){
+            raise_error("Failed allocation of `server client`.");
+        }
+        client->fd = fd;
+        client->in_fd = client->out_fd = client->err_fd = client->pid_fd = -1;
+        server_clients[id] = client;
+        server_watch(fd, POLLIN, id, SERVER_SOCKET);
+    }
+}
+
+// jshell --server path: serves commands on a UNIX socket, one forked worker
+// per connection, all multiplexed by the event loop
+int jshell_server(const char* path){
+    struct Event events[JSHELL_SERVER_EVENTS];
+    struct sockaddr_un addr;
+    int n, i, id, kind, status;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "jshell: --server: socket path too long\n");
+        return JSHELL_USAGE;
+    }
+    strcpy(addr.sun_path, path);
+
+    server_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if(server_listener < 0 || bind(server_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0
+       || listen(server_listener, JSHELL_SERVER_BACKLOG) < 0){
+        perror("jshell: --server");
+        return JSHELL_FAILED;
+    }
+
+    // workers get SIGPIPE back, the server only sees EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    event_watch(server_listener, POLLIN, SERVER_LISTENER);
+
+    for(;;){
+        n = event_wait(events, JSHELL_SERVER_EVENTS);
+        if(n < 0){
+            perror("jshell: --server");
+            return JSHELL_FAILED;
+        }
+
+        for(i=0; i<n; i++){
+            if(events[i].data == SERVER_LISTENER){
+                server_accept(server_listener);
+                continue;
+            }
+            if(events[i].data == SERVER_SIGCHLD){
+                server_reap();
+                continue;
+            }
+            id = events[i].data >> 3;
+            kind = events[i].data & 7;
+            // an earlier event of this round may have dropped it
+            if(id >= server_capacity || !server_clients[id]){
+                continue;
+            }
+            if(kind == SERVER_SOCKET){
+                if(events[i].events & (POLLIN | POLLHUP | POLLERR)){
+                    server_read_client(id);
+                }
+                if(server_clients[id] && (events[i].events & POLLOUT)){
+                    server_flush(id);
+                }
+            }
+            else if(kind == SERVER_PIDFD){
+                if(waitpid(server_clients[id]->worker, &status, WNOHANG) > 0){
+                    server_exited(id, status);
+                }
+            }
+            else if(kind == SERVER_STDIN){
+                server_feed(id);
+            }
+            else{
+                server_read_worker(id, kind, &events[i]);
+            }
+        }
+    }
+}
+
+// jshell --connect path cmd args...: runs the words as one command line on
+// a server, forwarding stdin and exiting with the command's status
+int jshell_connect(const char* path, char** words){
+    struct sockaddr_un addr;
+    struct Buffer request = { NULL, 0, 0 };
+    struct Buffer reply = { NULL, 0, 0 };
+    struct pollfd fds[2];
+    char data[JSHELL_FRAME_SIZE];
+    uint32_t code;
+    long length;
+    ssize_t n;
+    int fd;
+    int i;
+
+    if(words[0] == NULL){
+        fprintf(stderr, "jshell: --connect: usage: jshell --connect path cmd args...\n");
+        return JSHELL_USAGE;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        perror("jshell: --connect");
+        return JSHELL_FAILED;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for(i=0; words[i] != NULL; i++){
+        buffer_append(&reply, words[i], strlen(words[i]));
+        buffer_append(&reply, words[i+1] ? " " : "", words[i+1] ? 1 : 0);
+    }
+    frame_append(&request, FRAME_COMMAND, reply.data, reply.length);
+    reply.length = 0;
+    if(write_all(fd, request.data, request.length) < 0){
+        perror("jshell: --connect");
+        return JSHELL_FAILED;
+    }
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    for(;;){
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)){
+            n = read(STDIN_FILENO, data, sizeof(data));
+            request.length = 0;
+            frame_append(&request, FRAME_STDIN, data, n > 0 ? n : 0);
+            if(n <= 0){
+                // the empty frame is EOF, stdin isn't watched anymore
+                fds[1].fd = -1;
+            }
+            write_all(fd, request.data, request.length);
+        }
 
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+            n = read(fd, data, sizeof(data));
+            if(n <= 0){
+                fprintf(stderr, "jshell: --connect: connection closed\n");
+                return JSHELL_FAILED;
+            }
+            buffer_append(&reply, data, n);
+            while((length = frame_complete(&reply)) >= 0){
+                char* payload = reply.data + FRAME_HEADER;
+                if(reply.data[0] == FRAME_STDOUT){
+                    write_all(STDOUT_FILENO, payload, length);
+                }
+                else if(reply.data[0] == FRAME_STDERR){
+                    write_all(STDERR_FILENO, payload, length);
+                }
+                else if(reply.data[0] == FRAME_EXIT && length == 4){
+                    memcpy(&code, payload, 4);
+                    return ntohl(code);
+                }
+                buffer_consume(&reply, FRAME_HEADER + length);
+            }
+        }
+    }
+    return JSHELL_FAILED;
+}
+
+// END SERVER
+
+// Only what has to be there before the first command, the rest starts in
+// subsystem_need(). The environment store isn't built yet, so this reads
+// the process environment.
 void init(){
-    return;
+    long long start = startup.profile ? trace_now() : 0;
+
+    if(getenv("JSHELL_TRACE") && *getenv("JSHELL_TRACE")){
+        trace_open(getenv("JSHELL_TRACE"));
+    }
+    if(getenv("JSHELL_SLOW_MS")){
+        jshell_slow_ms = atoll(getenv("JSHELL_SLOW_MS"));
+    }
+    if(jshell_interactive){
+        // the terminal is taken and the prompt shown right away
+        subsystem_need(SUBSYSTEM_JOBS);
+        subsystem_need(SUBSYSTEM_PROMPT);
+        subsystem_need(SUBSYSTEM_COMPLETION);
+    }
+    if(startup.profile){
+        startup_phase("init", start);
+    }
 }
 
+// jshell                      interactive when stdin is a terminal
+// jshell script.jsh           run a script
+// jshell -c "cmd1 | cmd2"     run a command string
+// jshell --bench [iterations] run the built-in benchmarks
+// jshell --server path        serve commands on a UNIX socket
+// jshell --connect path cmd   run cmd on a server
+// jshell --startup-profile ...  report startup phases on exit
+// jshell --stress [rounds [min]] check for leaks under load
+#ifndef JSHELL_FUZZ
 int main(int argc, char** argv)
 {
+    int ret;
+
+    if(argc > 1 && strcmp(argv[1], "--startup-profile") == 0){
+        startup.profile = startup.first = 1;
+        startup.origin = trace_now();
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    if(argc > 1 && strcmp(argv[1], "--bench") == 0){
+        init();
+        ret = jshell_bench(argc > 2 ? atoi(argv[2]) : JSHELL_BENCH_ITERATIONS);
+        trace_close();
+        return ret;
+    }
+    if(argc > 1 && strcmp(argv[1], "--stress") == 0){
+        init();
+        ret = jshell_stress(argc > 2 ? atoi(argv[2]) : JSHELL_STRESS_ROUNDS, argc > 3 ? atof(argv[3]) : 0);
+        trace_close();
+        return ret;
+    }
+    if(argc > 2 && strcmp(argv[1], "--server") == 0){
+        init();
+        // a warm server has everything built before the first connection
+        subsystem_need(SUBSYSTEM_ENV);
+        subsystem_need(SUBSYSTEM_BUILTINS);
+        subsystem_need(SUBSYSTEM_JOBS);
+        ret = jshell_server(argv[2]);
+        trace_close();
+        return ret;
+    }
+    if(argc > 2 && strcmp(argv[1], "--connect") == 0){
+        return jshell_connect(argv[2], argv + 3);
+    }
+    if(argc > 1 && strcmp(argv[1], "-c") == 0){
+        if(argc < 3){
+            fprintf(stderr, "jshell: -c: option requires an argument\n");
+            return JSHELL_USAGE;
+        }
+        reader_open_string(argv[2]);
+        // like sh -c, the next words are $0, $1...
+        jshell_argc = argc - 3;
+        jshell_argv = argv + 3;
+    }
+    else if(argc > 1){
+        if(reader_open_script(argv[1]) != JSHELL_SUCCESS){
+            return JSHELL_NOT_FOUND;
+        }
+        jshell_argc = argc - 1;
+        jshell_argv = argv + 1;
+    }
+    else{
+        jshell_interactive = isatty(STDIN_FILENO);
+    }
+    if(jshell_argc == 0){
+        jshell_argc = 1;
+        jshell_argv = argv;
+    }
+
     init();
     jshell_loop();
+    trace_close();
+    if(startup.profile){
+        startup_report();
+    }
     
-    return EXIT_SUCCESS;
+    return jshell_status;
 }
+#endif